@@ -0,0 +1,382 @@
+#include "analysis.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+struct StandardHuffmanTable
+{
+	enum TableClass class;
+	uint8_t num_codes[16];
+	uint8_t values[162];
+};
+
+struct KnownTableSet
+{
+	uint64_t quantization_fingerprint;
+	const char* name;
+};
+
+struct EncoderFamily
+{
+	enum QuantizationStyle quantization;
+	enum HuffmanStyle huffman;
+	const char* name;
+};
+
+// ITU T.81 Annex K.1 tables in natural order, which IJG libjpeg scales by its quality factor
+static const uint16_t annex_k_luminance[64] =
+{
+	16, 11, 10, 16, 24, 40, 51, 61,
+	12, 12, 14, 19, 26, 58, 60, 55,
+	14, 13, 16, 24, 40, 57, 69, 56,
+	14, 17, 22, 29, 51, 87, 80, 62,
+	18, 22, 37, 56, 68, 109, 103, 77,
+	24, 35, 55, 64, 81, 104, 113, 92,
+	49, 64, 78, 87, 103, 121, 120, 101,
+	72, 92, 95, 98, 112, 100, 103, 99
+};
+
+static const uint16_t annex_k_chrominance[64] =
+{
+	17, 18, 24, 47, 99, 99, 99, 99,
+	18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99,
+	47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99
+};
+
+// ITU T.81 Annex K.3 tables, used by encoders that don't optimize their Huffman tables
+static const struct StandardHuffmanTable annex_k_huffman_tables[4] =
+{
+	{ DCTable,
+		{ 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+		{
+			0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B
+		}
+	},
+	{ DCTable,
+		{ 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+		{
+			0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B
+		}
+	},
+	{ ACTable,
+		{ 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125 },
+		{
+			0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+			0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+			0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0, 0x24, 0x33, 0x62, 0x72,
+			0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+			0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45,
+			0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+			0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75,
+			0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+			0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3,
+			0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+			0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9,
+			0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+			0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4,
+			0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA
+		}
+	},
+	{ ACTable,
+		{ 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119 },
+		{
+			0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+			0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+			0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0, 0x15, 0x62, 0x72, 0xD1,
+			0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+			0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44,
+			0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+			0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74,
+			0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+			0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
+			0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+			0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7,
+			0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+			0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4,
+			0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA
+		}
+	}
+};
+
+// Quantization table sets of known encoders and their default quality settings, matched by
+// quantization fingerprint before the families below. The fingerprints were taken from
+// libjpeg-turbo output; camera and editor tables are added the same way.
+static const struct KnownTableSet known_table_sets[] =
+{
+	{ 0xAF4C477A477CD07BULL, "IJG libjpeg quality 50, the unscaled Annex K tables" },
+	{ 0x6487425917C0702FULL, "IJG libjpeg quality 50, the unscaled Annex K tables, grayscale" },
+	{ 0x4A3199D5E16903FEULL, "IJG libjpeg quality 75, cjpeg and Pillow default" },
+	{ 0x3584FABD36ACB98FULL, "IJG libjpeg quality 75, cjpeg and Pillow default, grayscale" },
+	{ 0x3305BF2209D5F39CULL, "IJG libjpeg quality 80" },
+	{ 0x76D628A0D55BDE0CULL, "IJG libjpeg quality 80, grayscale" },
+	{ 0x3F170125A36D1EDBULL, "IJG libjpeg quality 85" },
+	{ 0xCE24F9CEB6887DECULL, "IJG libjpeg quality 85, grayscale" },
+	{ 0x08E81E60831A3A2CULL, "IJG libjpeg quality 90, GIMP default" },
+	{ 0x6885B2509F44ABCDULL, "IJG libjpeg quality 90, GIMP default, grayscale" },
+	{ 0x96888ECE8F56B609ULL, "IJG libjpeg quality 92, ImageMagick default" },
+	{ 0xEBD08EDE4F018483ULL, "IJG libjpeg quality 92, ImageMagick default, grayscale" },
+	{ 0xF3D4FCF3F47AD311ULL, "IJG libjpeg quality 95, OpenCV default" },
+	{ 0xF708E1DAB92340A6ULL, "IJG libjpeg quality 95, OpenCV default, grayscale" },
+	{ 0x8E89808AD9039E3AULL, "IJG libjpeg quality 100" },
+	{ 0xAE739BDF833E0EDFULL, "IJG libjpeg quality 100, grayscale" }
+};
+
+// Matched in order, the first family with both styles wins. Only styles that follow from the
+// standard tables are listed; the fingerprint tells apart encoders with custom tables.
+static const struct EncoderFamily encoder_families[] =
+{
+	{ QuantizationIJG, HuffmanStandard, "IJG libjpeg or a derivative (libjpeg-turbo, ...), default settings" },
+	{ QuantizationIJG, HuffmanOptimized, "IJG libjpeg or a derivative, optimized Huffman tables or progressive" },
+	{ QuantizationIJG, HuffmanArithmetic, "IJG libjpeg or a derivative, arithmetic coding" },
+	{ QuantizationIJG, HuffmanImplicit, "Motion JPEG frame with IJG quantization tables" },
+	{ QuantizationFlat, HuffmanAny, "Flat quantization tables" },
+	{ QuantizationCustom, HuffmanStandard, "Custom quantization with standard Huffman tables, e.g. camera firmware" },
+	{ QuantizationCustom, HuffmanOptimized, "Custom quantization with optimized Huffman tables, e.g. editors and optimizers" },
+	{ QuantizationCustom, HuffmanImplicit, "Motion JPEG frame" },
+	{ QuantizationNone, HuffmanAny, "No tables before the first scan" },
+};
+
+static void estimate_quality(const struct QuantizationTable* table, const uint16_t* base, struct QualityEstimate* estimate);
+static enum QuantizationStyle classify_quantization(JPEG* jpeg, const struct Analysis* analysis);
+static enum HuffmanStyle classify_huffman(JPEG* jpeg);
+static int is_standard_huffman_table(const struct HuffmanTable* table);
+static uint64_t hash_quantization_tables(JPEG* jpeg, uint64_t hash);
+static uint64_t hash_huffman_tables(JPEG* jpeg, uint64_t hash);
+static const char* find_encoder(const struct Analysis* analysis);
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+int analyze_jpeg(JPEG* jpeg, struct Analysis* analysis)
+{
+	assert(jpeg);
+	assert(analysis);
+
+	memset(analysis, 0, sizeof(struct Analysis));
+
+	// Without a frame header the tables are taken by their usual destinations
+	uint8_t luminance_destination = 0;
+	uint8_t chrominance_destination = 1;
+	int has_chrominance = 1;
+
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	if (frame_header != NULL)
+	{
+		luminance_destination = frame_header->components[0].quantization_table;
+		has_chrominance = frame_header->num_components > 1;
+
+		if (has_chrominance)
+			chrominance_destination = frame_header->components[1].quantization_table;
+	}
+
+	estimate_quality(find_quantization_table(jpeg, luminance_destination), annex_k_luminance, &analysis->luminance);
+	if (has_chrominance)
+		estimate_quality(find_quantization_table(jpeg, chrominance_destination), annex_k_chrominance, &analysis->chrominance);
+
+	analysis->quantization = classify_quantization(jpeg, analysis);
+	analysis->huffman = classify_huffman(jpeg);
+	analysis->quantization_fingerprint = hash_quantization_tables(jpeg, FNV_OFFSET_BASIS);
+	analysis->fingerprint = hash_huffman_tables(jpeg, analysis->quantization_fingerprint);
+	analysis->encoder = find_encoder(analysis);
+
+	return 0;
+}
+
+int analyze_jpeg_file(const char* filename, struct Analysis* analysis)
+{
+	assert(filename);
+
+	JPEG* jpeg = load_jpeg_with_flags(filename, LoadTablesOnly);
+	if (jpeg == NULL)
+	{
+		ERROR_LOG("Failed to load %s", filename);
+		return 1;
+	}
+
+	int result = analyze_jpeg(jpeg, analysis);
+	free_jpeg(jpeg);
+
+	return result;
+}
+
+void estimate_quality(const struct QuantizationTable* table, const uint16_t* base, struct QualityEstimate* estimate)
+{
+	if (table == NULL)
+		return;
+
+	uint16_t values[64];
+	get_quantization_values(table, values);
+
+	// 8-bit tables are clamped like libjpeg does with force_baseline
+	long max_value = (table->precision == sizeof(uint8_t)) ? 255 : 32767;
+
+	long best_error = -1;
+	for (int quality = 100; quality >= 1; quality--)
+	{
+		// jpeg_quality_scaling() and jpeg_add_quant_table() in libjpeg's jcparam.c
+		long scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+
+		long error = 0;
+		for (int i = 0; i < 64; i++)
+		{
+			long value = (base[i] * scale + 50) / 100;
+			value = (value < 1) ? 1 : (value > max_value) ? max_value : value;
+
+			error += labs(value - values[i]);
+		}
+
+		// Ties go to the higher quality
+		if (best_error < 0 || error < best_error)
+		{
+			best_error = error;
+			estimate->quality = quality;
+		}
+	}
+
+	estimate->exact = best_error == 0;
+	estimate->error = best_error / 64.0;
+}
+
+enum QuantizationStyle classify_quantization(JPEG* jpeg, const struct Analysis* analysis)
+{
+	if (jpeg->num_quantization_tables == 0 || analysis->luminance.quality == 0)
+		return QuantizationNone;
+
+	if (analysis->luminance.exact && (analysis->chrominance.quality == 0 || analysis->chrominance.exact))
+		return QuantizationIJG;
+
+	for (size_t i = 0; i < jpeg->num_quantization_tables; i++)
+	{
+		uint16_t values[64];
+		get_quantization_values(jpeg->quantization_tables + i, values);
+
+		for (int j = 1; j < 64; j++)
+		{
+			if (values[j] != values[0])
+				return QuantizationCustom;
+		}
+	}
+
+	return QuantizationFlat;
+}
+
+enum HuffmanStyle classify_huffman(JPEG* jpeg)
+{
+	if (jpeg->frame_header != NULL && (jpeg->frame_header->encoding & ENCODING_CODING_MASK) == Arithmetic)
+		return HuffmanArithmetic;
+
+	if (jpeg->num_huffman_tables == 0)
+		return HuffmanImplicit;
+
+	size_t num_standard = 0;
+	for (size_t i = 0; i < jpeg->num_huffman_tables; i++)
+		num_standard += is_standard_huffman_table(jpeg->huffman_tables + i);
+
+	if (num_standard == jpeg->num_huffman_tables)
+		return HuffmanStandard;
+
+	return (num_standard == 0) ? HuffmanOptimized : HuffmanMixed;
+}
+
+int is_standard_huffman_table(const struct HuffmanTable* table)
+{
+	for (size_t i = 0; i < sizeof(annex_k_huffman_tables) / sizeof(annex_k_huffman_tables[0]); i++)
+	{
+		const struct StandardHuffmanTable* standard = annex_k_huffman_tables + i;
+		if (standard->class != table->class || memcmp(standard->num_codes, table->num_codes, sizeof(standard->num_codes)) != 0)
+			continue;
+
+		int matches = 1;
+		size_t offset = 0;
+		for (int length = 0; length < 16 && matches; length++)
+		{
+			if (table->num_codes[length] > 0 && memcmp(table->codes[length], standard->values + offset, table->num_codes[length]) != 0)
+				matches = 0;
+
+			offset += table->num_codes[length];
+		}
+
+		if (matches)
+			return 1;
+	}
+
+	return 0;
+}
+
+uint64_t hash_quantization_tables(JPEG* jpeg, uint64_t hash)
+{
+	for (size_t i = 0; i < jpeg->num_quantization_tables; i++)
+	{
+		const struct QuantizationTable* table = jpeg->quantization_tables + i;
+
+		uint16_t values[64];
+		get_quantization_values(table, values);
+
+		hash = fnv1a(hash, &table->destination, sizeof(uint8_t));
+		for (int j = 0; j < 64; j++)
+		{
+			uint8_t bytes[2] = { (uint8_t)(values[j] >> 8), (uint8_t)values[j] };
+			hash = fnv1a(hash, bytes, sizeof(bytes));
+		}
+	}
+
+	return hash;
+}
+
+uint64_t hash_huffman_tables(JPEG* jpeg, uint64_t hash)
+{
+	for (size_t i = 0; i < jpeg->num_huffman_tables; i++)
+	{
+		const struct HuffmanTable* table = jpeg->huffman_tables + i;
+
+		uint8_t header[2] = { (uint8_t)table->class, table->destination };
+		hash = fnv1a(hash, header, sizeof(header));
+		hash = fnv1a(hash, table->num_codes, sizeof(table->num_codes));
+
+		for (int length = 0; length < 16; length++)
+		{
+			if (table->num_codes[length] > 0)
+				hash = fnv1a(hash, table->codes[length], table->num_codes[length]);
+		}
+	}
+
+	return hash;
+}
+
+const char* find_encoder(const struct Analysis* analysis)
+{
+	if (analysis->quantization != QuantizationNone)
+	{
+		for (size_t i = 0; i < sizeof(known_table_sets) / sizeof(known_table_sets[0]); i++)
+		{
+			if (known_table_sets[i].quantization_fingerprint == analysis->quantization_fingerprint)
+				return known_table_sets[i].name;
+		}
+	}
+
+	for (size_t i = 0; i < sizeof(encoder_families) / sizeof(encoder_families[0]); i++)
+	{
+		const struct EncoderFamily* family = encoder_families + i;
+		if (family->quantization == analysis->quantization && (family->huffman == HuffmanAny || family->huffman == analysis->huffman))
+			return family->name;
+	}
+
+	return "Unknown";
+}
@@ -0,0 +1,57 @@
+#ifndef _ANALYSIS_H
+#define _ANALYSIS_H
+
+#include <stdint.h>
+#include "loader.h"
+
+enum QuantizationStyle
+{
+	QuantizationNone,		// No tables before the first scan
+	QuantizationIJG,		// Annex K tables scaled exactly like IJG libjpeg does
+	QuantizationFlat,		// The same value for every coefficient
+	QuantizationCustom
+};
+
+enum HuffmanStyle
+{
+	HuffmanStandard,		// Only the Annex K tables
+	HuffmanOptimized,		// Only tables built for the image
+	HuffmanMixed,
+	HuffmanImplicit,		// No tables before the first scan, as in Motion JPEG frames
+	HuffmanArithmetic,		// Arithmetic coding, there are no Huffman tables
+	HuffmanAny				// Only used to match encoder families
+};
+
+struct QualityEstimate
+{
+	int quality;			// Closest IJG quality factor (1-100), 0 if there is no table
+	int exact;				// The table is exactly the IJG table for quality
+	double error;			// Mean absolute difference to that table per coefficient
+};
+
+struct Analysis
+{
+	struct QualityEstimate luminance;
+	struct QualityEstimate chrominance;		// Quality 0 for grayscale images
+
+	enum QuantizationStyle quantization;
+	enum HuffmanStyle huffman;
+
+	// FNV-1a hash of all quantization and Huffman tables, identical for identical table sets
+	uint64_t fingerprint;
+
+	// FNV-1a hash of the quantization tables alone, which known encoders are matched by since
+	// their Huffman tables change with optimization
+	uint64_t quantization_fingerprint;
+
+	// Known encoder the quantization tables belong to, or the encoder family the table styles
+	// point to, both from built-in lists
+	const char* encoder;
+};
+
+// Analyzes the tables defined before the first scan. Loading with LoadTablesOnly is enough and
+// doesn't read anything past the first scan header.
+int analyze_jpeg(JPEG* jpeg, struct Analysis* analysis);
+int analyze_jpeg_file(const char* filename, struct Analysis* analysis);
+
+#endif // _ANALYSIS_H
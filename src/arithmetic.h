@@ -0,0 +1,101 @@
+#ifndef _ARITHMETIC_H
+#define _ARITHMETIC_H
+
+#include "bitreader.h"
+
+#define ARITHMETIC_DC_STATISTICS 64
+#define ARITHMETIC_AC_STATISTICS 256
+
+// Index of the extra state with a fixed probability of 0.5, used for sign and correction bits
+#define ARITHMETIC_FIXED_STATE 113
+
+// Probability estimation state machine of the QM-coder (ITU T.81, Table D.2)
+struct ArithmeticState
+{
+	uint16_t qe;
+	uint8_t next_lps;
+	uint8_t next_mps;
+	uint8_t switch_mps;
+};
+
+extern const struct ArithmeticState arithmetic_states[ARITHMETIC_FIXED_STATE + 1];
+
+// Decoder registers (T.81, D.2). Statistics bins hold the state index in the lower 7 bits and
+// the more probable symbol in the top bit.
+struct ArithmeticDecoder
+{
+	uint32_t c;
+	uint32_t a;
+	int ct;
+};
+
+// Has to be called at the start of every scan and restart interval
+static inline void reset_arithmetic_decoder(struct ArithmeticDecoder* decoder)
+{
+	decoder->c = 0;
+	decoder->a = 0;
+	decoder->ct = -16;	// Forces reading the two initial bytes (T.81, D.2.7)
+}
+
+// Decodes one binary decision and updates its statistics bin (T.81, D.2.4 - D.2.6).
+// Data bytes come from the bit reader, which already removes stuffing and supplies zero bytes
+// once a marker is reached, as INITDEC and BYTEIN require.
+static inline int decode_arithmetic(struct ArithmeticDecoder* decoder, struct BitReader* reader, uint8_t* bin)
+{
+	while (decoder->a < 0x8000)
+	{
+		if (--decoder->ct < 0)
+		{
+			decoder->c = (decoder->c << 8) | get_bits(reader, 8);
+			decoder->ct += 8;
+
+			// Still reading the initial bytes
+			if (decoder->ct < 0 && ++decoder->ct == 0)
+				decoder->a = 0x8000;
+		}
+
+		decoder->a <<= 1;
+	}
+
+	uint8_t value = *bin;
+	const struct ArithmeticState* state = arithmetic_states + (value & 0x7F);
+	uint32_t qe = state->qe;
+	int symbol = value >> 7;
+
+	decoder->a -= qe;
+	uint32_t scaled = decoder->a << decoder->ct;
+
+	if (decoder->c >= scaled)
+	{
+		decoder->c -= scaled;
+
+		// Conditional exchange, the LPS interval is the larger one
+		if (decoder->a < qe)
+		{
+			*bin = (value & 0x80) | state->next_mps;
+		}
+		else
+		{
+			*bin = ((value & 0x80) ^ (state->switch_mps << 7)) | state->next_lps;
+			symbol ^= 1;
+		}
+
+		decoder->a = qe;
+	}
+	else if (decoder->a < 0x8000)
+	{
+		if (decoder->a < qe)
+		{
+			*bin = ((value & 0x80) ^ (state->switch_mps << 7)) | state->next_lps;
+			symbol ^= 1;
+		}
+		else
+		{
+			*bin = (value & 0x80) | state->next_mps;
+		}
+	}
+
+	return symbol;
+}
+
+#endif // _ARITHMETIC_H
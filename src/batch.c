@@ -0,0 +1,699 @@
+#include "batch.h"
+#include "context.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#ifdef JPEGDISSECT_HAVE_IO_URING
+	#include <linux/io_uring.h>
+	#include <sys/syscall.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/uio.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
+#ifdef JPEGDISSECT_HAVE_PTHREAD
+	#include <pthread.h>
+#endif
+
+struct BatchBuffer
+{
+	size_t file_index;
+	uint8_t* data;
+	size_t size;
+
+	struct BatchBuffer* next;
+};
+
+static void parse_buffer(DecoderContext* context, const char* filename, uint8_t* data, size_t size, BatchCallback callback, void* user_data);
+static int read_file(const char* filename, uint8_t** data, size_t* size);
+
+static int load_batch_sequential(DecoderContext* context, const char** filenames, size_t num_files, BatchCallback callback, void* user_data);
+
+#ifdef JPEGDISSECT_HAVE_PTHREAD
+static int load_batch_threaded(DecoderContext* context, const char** filenames, size_t num_files, size_t max_in_flight, BatchCallback callback, void* user_data);
+#endif
+
+#ifdef JPEGDISSECT_HAVE_IO_URING
+static int load_batch_io_uring(DecoderContext* context, const char** filenames, size_t num_files, size_t max_in_flight, BatchCallback callback, void* user_data);
+#endif
+
+int load_jpeg_batch(const char** filenames, size_t num_files, size_t max_in_flight, BatchCallback callback, void* user_data)
+{
+	return load_jpeg_batch_with_flags(filenames, num_files, max_in_flight, LoadIndexOnly, callback, user_data);
+}
+
+int load_jpeg_batch_with_flags(const char** filenames, size_t num_files, size_t max_in_flight, unsigned flags, BatchCallback callback, void* user_data)
+{
+	assert(filenames);
+	assert(callback);
+
+	if (max_in_flight == 0)
+		max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+
+	DecoderContext* context = create_decoder_context();
+	if (context == NULL)
+		return 1;
+
+	decoder_set_flags(context, flags);
+
+	int result = -1;
+
+#ifdef JPEGDISSECT_HAVE_IO_URING
+	// Falls through to the thread pool if the kernel doesn't support io_uring
+	result = load_batch_io_uring(context, filenames, num_files, max_in_flight, callback, user_data);
+#endif
+
+#ifdef JPEGDISSECT_HAVE_PTHREAD
+	if (result < 0)
+		result = load_batch_threaded(context, filenames, num_files, max_in_flight, callback, user_data);
+#endif
+
+	if (result < 0)
+		result = load_batch_sequential(context, filenames, num_files, callback, user_data);
+
+	free_decoder_context(context);
+	return result;
+}
+
+void parse_buffer(DecoderContext* context, const char* filename, uint8_t* data, size_t size, BatchCallback callback, void* user_data)
+{
+	JPEG* jpeg = NULL;
+	char error[MAX_ERROR_MESSAGE_SIZE + 32];
+	snprintf(error, sizeof(error), "Failed to read file");
+
+	if (data != NULL)
+	{
+		FILE* fp = open_memory_file(data, size);
+		if (fp != NULL)
+		{
+			jpeg = decoder_load_jpeg_stream(context, fp);
+
+			long offset = 0;
+			const char* message = decoder_error(context, &offset);
+			if (message != NULL)
+				snprintf(error, sizeof(error), "%s (offset %ld)", message, offset);
+		}
+	}
+
+	callback(filename, jpeg, (jpeg == NULL) ? error : NULL, user_data);
+
+	free_jpeg(jpeg);
+	free(data);
+}
+
+int read_file(const char* filename, uint8_t** data, size_t* size)
+{
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		ERROR_LOG("Failed to open %s", filename);
+		return 1;
+	}
+
+	if (fseek(fp, 0, SEEK_END) != 0)
+	{
+		ERROR_LOG("Failed to determine size of %s", filename);
+		fclose(fp);
+		return 1;
+	}
+
+	long file_size = ftell(fp);
+	rewind(fp);
+
+	if (file_size <= 0)
+	{
+		ERROR_LOG("%s is empty", filename);
+		fclose(fp);
+		return 1;
+	}
+
+	*data = (uint8_t*)malloc(file_size);
+	if (*data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for %s", filename);
+		fclose(fp);
+		return 1;
+	}
+
+	*size = fread(*data, sizeof(uint8_t), file_size, fp);
+	fclose(fp);
+
+	if (*size == 0)
+	{
+		ERROR_LOG("Failed to read %s", filename);
+		free(*data);
+		*data = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+int load_batch_sequential(DecoderContext* context, const char** filenames, size_t num_files, BatchCallback callback, void* user_data)
+{
+	for (size_t i = 0; i < num_files; i++)
+	{
+		uint8_t* data = NULL;
+		size_t size = 0;
+
+		read_file(filenames[i], &data, &size);
+		parse_buffer(context, filenames[i], data, size, callback, user_data);
+	}
+
+	return 0;
+}
+
+#ifdef JPEGDISSECT_HAVE_PTHREAD
+
+#define MAX_WORKER_THREADS 64
+
+struct ThreadPool
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t read_finished;
+	pthread_cond_t buffer_parsed;
+
+	const char** filenames;
+	size_t num_files;
+	size_t next_file;
+
+	// Files that are being read or waiting to be parsed
+	size_t in_flight;
+	size_t max_in_flight;
+
+	struct BatchBuffer* completed_head;
+	struct BatchBuffer* completed_tail;
+
+	// Files a worker couldn't queue a buffer for, at most max_in_flight at a time
+	size_t* failed_files;
+	size_t num_failed;
+};
+
+static void* worker_thread(void* arg);
+
+int load_batch_threaded(DecoderContext* context, const char** filenames, size_t num_files, size_t max_in_flight, BatchCallback callback, void* user_data)
+{
+	struct ThreadPool pool;
+	memset(&pool, 0, sizeof(struct ThreadPool));
+
+	pool.filenames = filenames;
+	pool.num_files = num_files;
+	pool.max_in_flight = max_in_flight;
+
+	pool.failed_files = (size_t*)malloc(sizeof(size_t) * max_in_flight);
+	if (pool.failed_files == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for the thread pool");
+		return -1;
+	}
+
+	size_t num_threads = max_in_flight;
+	if (num_threads > num_files)
+		num_threads = num_files;
+	if (num_threads > MAX_WORKER_THREADS)
+		num_threads = MAX_WORKER_THREADS;
+
+	pthread_t threads[MAX_WORKER_THREADS];
+
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.read_finished, NULL);
+	pthread_cond_init(&pool.buffer_parsed, NULL);
+
+	size_t num_started = 0;
+	for (; num_started < num_threads; num_started++)
+	{
+		if (pthread_create(threads + num_started, NULL, worker_thread, &pool) != 0)
+			break;
+	}
+
+	int result = 0;
+	if (num_started == 0 && num_files > 0)
+	{
+		ERROR_LOG("Failed to start worker threads");
+		result = -1;
+	}
+
+	for (size_t parsed = 0; result == 0 && parsed < num_files; parsed++)
+	{
+		pthread_mutex_lock(&pool.mutex);
+		while (pool.completed_head == NULL && pool.num_failed == 0)
+			pthread_cond_wait(&pool.read_finished, &pool.mutex);
+
+		if (pool.num_failed > 0)
+		{
+			size_t file_index = pool.failed_files[--pool.num_failed];
+			pthread_mutex_unlock(&pool.mutex);
+
+			parse_buffer(context, filenames[file_index], NULL, 0, callback, user_data);
+		}
+		else
+		{
+			struct BatchBuffer* buffer = pool.completed_head;
+			pool.completed_head = buffer->next;
+			if (pool.completed_head == NULL)
+				pool.completed_tail = NULL;
+
+			pthread_mutex_unlock(&pool.mutex);
+
+			parse_buffer(context, filenames[buffer->file_index], buffer->data, buffer->size, callback, user_data);
+			free(buffer);
+		}
+
+		pthread_mutex_lock(&pool.mutex);
+		pool.in_flight--;
+		pthread_cond_signal(&pool.buffer_parsed);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+
+	for (size_t i = 0; i < num_started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&pool.buffer_parsed);
+	pthread_cond_destroy(&pool.read_finished);
+	pthread_mutex_destroy(&pool.mutex);
+
+	free(pool.failed_files);
+	return result;
+}
+
+void* worker_thread(void* arg)
+{
+	struct ThreadPool* pool = (struct ThreadPool*)arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->next_file < pool->num_files && pool->in_flight >= pool->max_in_flight)
+			pthread_cond_wait(&pool->buffer_parsed, &pool->mutex);
+
+		if (pool->next_file == pool->num_files)
+		{
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+
+		size_t file_index = pool->next_file++;
+		pool->in_flight++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		// A failed read is still queued so the parsing side reports it
+		struct BatchBuffer* buffer = (struct BatchBuffer*)malloc(sizeof(struct BatchBuffer));
+		if (buffer == NULL)
+		{
+			ERROR_LOG("Failed to allocate memory for %s", pool->filenames[file_index]);
+
+			pthread_mutex_lock(&pool->mutex);
+			pool->failed_files[pool->num_failed++] = file_index;
+			pthread_cond_signal(&pool->read_finished);
+			pthread_mutex_unlock(&pool->mutex);
+			continue;
+		}
+
+		memset(buffer, 0, sizeof(struct BatchBuffer));
+		buffer->file_index = file_index;
+		read_file(pool->filenames[file_index], &buffer->data, &buffer->size);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->completed_tail != NULL)
+			pool->completed_tail->next = buffer;
+		else
+			pool->completed_head = buffer;
+
+		pool->completed_tail = buffer;
+		pthread_cond_signal(&pool->read_finished);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+#endif // JPEGDISSECT_HAVE_PTHREAD
+
+#ifdef JPEGDISSECT_HAVE_IO_URING
+
+struct Ring
+{
+	int fd;
+
+	void* sq_ptr;
+	size_t sq_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+
+	void* cq_ptr;
+	size_t cq_size;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+};
+
+struct ReadSlot
+{
+	int fd;
+	size_t file_index;
+
+	uint8_t* data;
+	size_t size;
+	size_t offset;
+	int pending;	// A read was queued and hasn't completed yet
+
+	struct iovec iov;
+};
+
+static int setup_ring(struct Ring* ring, unsigned entries);
+static void destroy_ring(struct Ring* ring);
+static int start_read(struct Ring* ring, struct ReadSlot* slot, size_t slot_index, const char* filename, size_t file_index);
+static void queue_read(struct Ring* ring, struct ReadSlot* slot, size_t slot_index);
+static size_t drain_reads(struct Ring* ring, struct ReadSlot* slots, size_t num_slots);
+
+int load_batch_io_uring(DecoderContext* context, const char** filenames, size_t num_files, size_t max_in_flight, BatchCallback callback, void* user_data)
+{
+	struct Ring ring;
+	if (setup_ring(&ring, (unsigned)max_in_flight) != 0)
+	{
+		DEBUG_LOG("io_uring is unavailable, falling back to worker threads");
+		return -1;
+	}
+
+	struct ReadSlot* slots = (struct ReadSlot*)malloc(sizeof(struct ReadSlot) * max_in_flight);
+	size_t* free_slots = (size_t*)malloc(sizeof(size_t) * max_in_flight);
+	if (slots == NULL || free_slots == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for read slots");
+		free(slots);
+		free(free_slots);
+		destroy_ring(&ring);
+		return -1;
+	}
+
+	size_t num_free_slots = max_in_flight;
+	for (size_t i = 0; i < max_in_flight; i++)
+	{
+		free_slots[i] = i;
+		slots[i].fd = -1;
+		slots[i].pending = 0;
+	}
+
+	size_t next_file = 0;
+	size_t in_flight = 0;
+	unsigned to_submit = 0;
+	int result = 0;
+
+	while (next_file < num_files || in_flight > 0)
+	{
+		// Fill every free slot before waiting, so reads overlap with the parsing below
+		while (next_file < num_files && num_free_slots > 0)
+		{
+			size_t slot_index = free_slots[--num_free_slots];
+			if (start_read(&ring, slots + slot_index, slot_index, filenames[next_file], next_file) != 0)
+			{
+				free_slots[num_free_slots++] = slot_index;
+				parse_buffer(context, filenames[next_file], NULL, 0, callback, user_data);
+				next_file++;
+				continue;
+			}
+
+			next_file++;
+			in_flight++;
+			to_submit++;
+		}
+
+		if (in_flight == 0)
+			continue;
+
+		long submitted = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			ERROR_LOG("io_uring_enter failed");
+			result = 1;
+			break;
+		}
+
+		to_submit -= (unsigned)submitted;
+
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe* cqe = ring.cqes + (head & *ring.cq_mask);
+			size_t slot_index = (size_t)cqe->user_data;
+			int res = cqe->res;
+			head++;
+
+			struct ReadSlot* slot = slots + slot_index;
+			slot->pending = 0;
+
+			if (res > 0)
+			{
+				slot->offset += (size_t)res;
+				if (slot->offset < slot->size)
+				{
+					// Short read, ask for the rest with the next submission
+					queue_read(&ring, slot, slot_index);
+					to_submit++;
+					continue;
+				}
+			}
+			else if (res < 0)
+			{
+				ERROR_LOG("Failed to read %s", filenames[slot->file_index]);
+				free(slot->data);
+				slot->data = NULL;
+			}
+
+			close(slot->fd);
+			slot->fd = -1;
+
+			// A file that shrank while it was read is parsed as far as it got
+			parse_buffer(context, filenames[slot->file_index], slot->data, slot->offset, callback, user_data);
+
+			free_slots[num_free_slots++] = slot_index;
+			in_flight--;
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// Closing the ring doesn't cancel reads the kernel already took, so they are waited for
+	// before their buffers are released. Whatever can't be waited for is leaked instead.
+	size_t num_pending = (result != 0) ? drain_reads(&ring, slots, max_in_flight) : 0;
+	destroy_ring(&ring);
+
+	if (result != 0)
+	{
+		if (num_pending > 0)
+		{
+			ERROR_LOG("%zu reads are still in flight, leaking their buffers", num_pending);
+		}
+
+		// Every file that didn't complete is still reported, as a failed one
+		for (size_t i = 0; i < max_in_flight; i++)
+		{
+			struct ReadSlot* slot = slots + i;
+			if (slot->fd < 0)
+				continue;
+
+			close(slot->fd);
+			if (!slot->pending)
+				free(slot->data);
+
+			parse_buffer(context, filenames[slot->file_index], NULL, 0, callback, user_data);
+		}
+
+		for (; next_file < num_files; next_file++)
+			parse_buffer(context, filenames[next_file], NULL, 0, callback, user_data);
+	}
+
+	free(free_slots);
+	if (num_pending == 0)
+		free(slots);
+
+	return result;
+}
+
+int setup_ring(struct Ring* ring, unsigned entries)
+{
+	memset(ring, 0, sizeof(struct Ring));
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(struct io_uring_params));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return 1;
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+	{
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+	{
+		close(ring->fd);
+		return 1;
+	}
+
+	if (single_mmap)
+	{
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+		{
+			munmap(ring->sq_ptr, ring->sq_size);
+			close(ring->fd);
+			return 1;
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		if (!single_mmap)
+			munmap(ring->cq_ptr, ring->cq_size);
+		munmap(ring->sq_ptr, ring->sq_size);
+		close(ring->fd);
+		return 1;
+	}
+
+	uint8_t* sq = (uint8_t*)ring->sq_ptr;
+	ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+	uint8_t* cq = (uint8_t*)ring->cq_ptr;
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+void destroy_ring(struct Ring* ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+int start_read(struct Ring* ring, struct ReadSlot* slot, size_t slot_index, const char* filename, size_t file_index)
+{
+	memset(slot, 0, sizeof(struct ReadSlot));
+	slot->file_index = file_index;
+
+	slot->fd = open(filename, O_RDONLY);
+	if (slot->fd < 0)
+	{
+		ERROR_LOG("Failed to open %s", filename);
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(slot->fd, &st) != 0 || st.st_size <= 0)
+	{
+		ERROR_LOG("Failed to determine size of %s", filename);
+		close(slot->fd);
+		slot->fd = -1;
+		return 1;
+	}
+
+	slot->size = (size_t)st.st_size;
+	slot->data = (uint8_t*)malloc(slot->size);
+	if (slot->data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for %s", filename);
+		close(slot->fd);
+		slot->fd = -1;
+		return 1;
+	}
+
+	queue_read(ring, slot, slot_index);
+	return 0;
+}
+
+void queue_read(struct Ring* ring, struct ReadSlot* slot, size_t slot_index)
+{
+	slot->iov.iov_base = slot->data + slot->offset;
+	slot->iov.iov_len = slot->size - slot->offset;
+
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+
+	struct io_uring_sqe* sqe = ring->sqes + index;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = slot->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+	sqe->len = 1;
+	sqe->off = slot->offset;
+	sqe->user_data = slot_index;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	slot->pending = 1;
+}
+
+size_t drain_reads(struct Ring* ring, struct ReadSlot* slots, size_t num_slots)
+{
+	// Reads still in the submission queue never reached the kernel
+	unsigned tail = *ring->sq_tail;
+	for (unsigned i = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE); i != tail; i++)
+		slots[ring->sqes[ring->sq_array[i & *ring->sq_mask]].user_data].pending = 0;
+
+	size_t num_pending = 0;
+	for (size_t i = 0; i < num_slots; i++)
+		num_pending += slots[i].pending;
+
+	while (num_pending > 0)
+	{
+		long result = syscall(__NR_io_uring_enter, ring->fd, 0, (unsigned)num_pending, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (result < 0 && errno != EINTR)
+			break;
+
+		unsigned head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct ReadSlot* slot = slots + ring->cqes[head & *ring->cq_mask].user_data;
+			if (slot->pending)
+			{
+				slot->pending = 0;
+				num_pending--;
+			}
+
+			head++;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return num_pending;
+}
+
+#endif // JPEGDISSECT_HAVE_IO_URING
@@ -0,0 +1,21 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stddef.h>
+#include "loader.h"
+
+#define DEFAULT_MAX_IN_FLIGHT 32
+
+// Called on the calling thread for every file once it has been read and parsed, in completion order.
+// jpeg is NULL if the file couldn't be read or parsed, and error then says why. The image and the
+// buffer it was parsed from are released when the callback returns.
+typedef void (*BatchCallback)(const char* filename, JPEG* jpeg, const char* error, void* user_data);
+
+// Reads the files asynchronously (io_uring where available, a thread pool otherwise) with at most
+// max_in_flight files read but not yet parsed, and parses the completed buffers in memory.
+int load_jpeg_batch(const char** filenames, size_t num_files, size_t max_in_flight, BatchCallback callback, void* user_data);
+
+// Same as load_jpeg_batch(), parsing every file with the given LoadFlags
+int load_jpeg_batch_with_flags(const char** filenames, size_t num_files, size_t max_in_flight, unsigned flags, BatchCallback callback, void* user_data);
+
+#endif // _BATCH_H
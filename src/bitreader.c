@@ -0,0 +1,155 @@
+#include "bitreader.h"
+
+#include <memory.h>
+#include <assert.h>
+
+static int read_byte(struct BitReader* reader);
+
+void init_bit_reader(struct BitReader* reader, FILE* fp)
+{
+	assert(reader);
+	assert(fp);
+
+	memset(reader, 0, sizeof(struct BitReader));
+
+	reader->fp = fp;
+	reader->buffer_offset = ftell(fp);
+}
+
+int read_byte(struct BitReader* reader)
+{
+	if (reader->position == reader->length)
+	{
+		reader->buffer_offset += (long)reader->length;
+		reader->length = fread(reader->buffer, sizeof(uint8_t), BIT_READER_BUFFER_SIZE, reader->fp);
+		reader->position = 0;
+
+		if (reader->length == 0)
+			return -1;
+	}
+
+	return reader->buffer[reader->position++];
+}
+
+void fill_bits(struct BitReader* reader)
+{
+	while (reader->num_bits <= 56)
+	{
+		int byte = 0;
+
+		if (!reader->exhausted)
+		{
+			byte = read_byte(reader);
+			if (byte < 0)
+			{
+				reader->exhausted = 1;
+				reader->marker = 0;
+				reader->end_offset = reader->buffer_offset + (long)reader->position;
+				byte = 0;
+			}
+			else if (byte == 0xFF)
+			{
+				long marker_offset = reader->buffer_offset + (long)reader->position - 1;
+
+				// Any number of fill bytes may come before the marker code
+				int code;
+				do
+				{
+					code = read_byte(reader);
+				} while (code == 0xFF);
+
+				if (code != 0x00)
+				{
+					reader->exhausted = 1;
+					reader->marker = (code < 0) ? 0 : (uint8_t)code;
+					reader->end_offset = marker_offset;
+					byte = 0;
+				}
+			}
+		}
+
+		if (reader->exhausted)
+			reader->padding_bits += 8;
+
+		reader->bits |= (uint64_t)byte << (56 - reader->num_bits);
+		reader->num_bits += 8;
+	}
+}
+
+size_t skip_to_marker(struct BitReader* reader)
+{
+	assert(reader);
+
+	// Whole bytes left in the bit buffer are data that was never decoded
+	size_t skipped = 0;
+	if (reader->num_bits > reader->padding_bits)
+		skipped = (size_t)(reader->num_bits - reader->padding_bits) / 8;
+
+	reader->bits = 0;
+	reader->num_bits = 0;
+	reader->padding_bits = 0;
+
+	while (!reader->exhausted)
+	{
+		int byte = read_byte(reader);
+		if (byte < 0)
+		{
+			reader->exhausted = 1;
+			reader->marker = 0;
+			reader->end_offset = reader->buffer_offset + (long)reader->position;
+			break;
+		}
+
+		if (byte != 0xFF)
+		{
+			skipped++;
+			continue;
+		}
+
+		long marker_offset = reader->buffer_offset + (long)reader->position - 1;
+
+		int code;
+		do
+		{
+			code = read_byte(reader);
+		} while (code == 0xFF);
+
+		if (code == 0x00)
+		{
+			skipped++;
+			continue;
+		}
+
+		reader->exhausted = 1;
+		reader->marker = (code < 0) ? 0 : (uint8_t)code;
+		reader->end_offset = marker_offset;
+	}
+
+	return skipped;
+}
+
+void consume_marker(struct BitReader* reader)
+{
+	assert(reader);
+
+	reader->exhausted = 0;
+	reader->marker = 0;
+}
+
+int finish_bit_reader(struct BitReader* reader)
+{
+	assert(reader);
+
+	return fseek(reader->fp, reader->end_offset, SEEK_SET);
+}
+
+long bit_reader_offset(const struct BitReader* reader)
+{
+	assert(reader);
+
+	long offset = reader->buffer_offset + (long)reader->position - (reader->num_bits - reader->padding_bits) / 8;
+	if (reader->exhausted && offset > reader->end_offset)
+		offset = reader->end_offset;
+
+	return offset;
+}
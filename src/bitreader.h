@@ -0,0 +1,81 @@
+#ifndef _BITREADER_H
+#define _BITREADER_H
+
+#include <stdint.h>
+#include "util.h"
+
+#define BIT_READER_BUFFER_SIZE 4096
+
+// Reads entropy-coded data from a stream, removing stuffed zero bytes. Once a marker (or the end
+// of the stream) is reached, zero bits are handed out instead and counted in padding_bits.
+struct BitReader
+{
+	FILE* fp;
+
+	long buffer_offset;		// Offset of buffer[0] in the stream
+	size_t position;
+	size_t length;
+	uint8_t buffer[BIT_READER_BUFFER_SIZE];
+
+	uint64_t bits;			// Left-aligned
+	int num_bits;
+	int padding_bits;
+
+	int exhausted;
+	uint8_t marker;			// 0 if the stream ended without a marker
+	long end_offset;		// Offset of the marker's 0xFF or the end of the stream
+};
+
+void init_bit_reader(struct BitReader* reader, FILE* fp);
+void fill_bits(struct BitReader* reader);
+
+// Drops the remaining bits and reads up to the next marker. Returns the number of data
+// bytes that were skipped on the way, which is 0 for well-formed entropy-coded data.
+size_t skip_to_marker(struct BitReader* reader);
+
+// Continues reading after an RSTn marker found by skip_to_marker()
+void consume_marker(struct BitReader* reader);
+
+// Moves the stream to the marker (or end of stream) that ended the entropy-coded data
+int finish_bit_reader(struct BitReader* reader);
+
+// Approximate offset of the next unread bit
+long bit_reader_offset(const struct BitReader* reader);
+
+static inline uint32_t peek_bits(struct BitReader* reader, int count)
+{
+	if (reader->num_bits < count)
+		fill_bits(reader);
+
+	return (uint32_t)(reader->bits >> (64 - count));
+}
+
+static inline void skip_bits(struct BitReader* reader, int count)
+{
+	reader->bits <<= count;
+	reader->num_bits -= count;
+}
+
+static inline uint32_t get_bits(struct BitReader* reader, int count)
+{
+	if (count == 0)
+		return 0;
+
+	uint32_t value = peek_bits(reader, count);
+	skip_bits(reader, count);
+
+	return value;
+}
+
+static inline int get_bit(struct BitReader* reader)
+{
+	return (int)get_bits(reader, 1);
+}
+
+// Consumed bits that were made up after the end of the entropy-coded data
+static inline int bit_reader_overrun(const struct BitReader* reader)
+{
+	return reader->padding_bits > reader->num_bits;
+}
+
+#endif // _BITREADER_H
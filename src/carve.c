@@ -0,0 +1,219 @@
+#include "carve.h"
+#include "context.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+static int is_segment_marker(uint8_t code);
+static unsigned count_trailing_zeros(uint32_t mask);
+
+size_t carve_jpegs(const uint8_t* data, size_t size, CarveCallback callback, void* user_data)
+{
+	assert(data);
+	assert(callback);
+
+	DecoderContext* context = create_decoder_context();
+	if (context == NULL)
+		return 0;
+
+	size_t num_images = 0;
+	size_t offset = find_start_of_image(data, size, 0);
+
+	while (offset < size)
+	{
+		// Cheap check of the first marker before running the parser
+		if (offset + 4 > size || !is_segment_marker(data[offset + 3]))
+		{
+			offset = find_start_of_image(data, size, offset + 1);
+			continue;
+		}
+
+		JPEG* jpeg = NULL;
+
+		FILE* fp = open_memory_file(data + offset, size - offset);
+		if (fp != NULL)
+			jpeg = decoder_load_jpeg_stream(context, fp);
+
+		if (jpeg == NULL || jpeg->frame_header == NULL)
+		{
+			free_jpeg(jpeg);
+			offset = find_start_of_image(data, size, offset + 1);
+			continue;
+		}
+
+		// The parser stops right after the EOI marker
+		struct CarvedImage image;
+		image.offset = offset;
+		image.length = (size_t)ftell(jpeg->fp);
+		image.data = data + offset;
+
+		callback(&image, jpeg, user_data);
+		free_jpeg(jpeg);
+
+		num_images++;
+		offset = find_start_of_image(data, size, offset + image.length);
+	}
+
+	free_decoder_context(context);
+	return num_images;
+}
+
+size_t carve_file(const char* filename, CarveCallback callback, void* user_data)
+{
+	assert(filename);
+
+#if defined(_MSC_VER)
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		ERROR_LOG("Failed to open %s", filename);
+		return (size_t)-1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	rewind(fp);
+
+	uint8_t* data = (uint8_t*)malloc(size > 0 ? size : 1);
+	if (data == NULL || fread(data, sizeof(uint8_t), size, fp) != (size_t)size)
+	{
+		ERROR_LOG("Failed to read %s", filename);
+		free(data);
+		fclose(fp);
+		return (size_t)-1;
+	}
+
+	fclose(fp);
+
+	size_t num_images = carve_jpegs(data, size, callback, user_data);
+	free(data);
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		ERROR_LOG("Failed to open %s", filename);
+		return (size_t)-1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		ERROR_LOG("Failed to determine size of %s", filename);
+		close(fd);
+		return (size_t)-1;
+	}
+
+	size_t size = (size_t)st.st_size;
+	if (size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	uint8_t* data = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		ERROR_LOG("Failed to map %s", filename);
+		return (size_t)-1;
+	}
+
+	// The file is read front to back
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	size_t num_images = carve_jpegs(data, size, callback, user_data);
+	munmap(data, size);
+#endif
+
+	return num_images;
+}
+
+size_t find_start_of_image(const uint8_t* data, size_t size, size_t start)
+{
+	assert(data);
+
+	if (size < 3)
+		return size;
+
+	size_t offset = start;
+	size_t last = size - 2;	// Last offset a full sequence can start at is size - 3
+
+#if defined(__AVX2__)
+	const __m256i ff = _mm256_set1_epi8((char)0xFF);
+	const __m256i d8 = _mm256_set1_epi8((char)0xD8);
+
+	for (; offset + 2 + 32 <= size; offset += 32)
+	{
+		__m256i first = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + offset)), ff);
+		__m256i second = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + offset + 1)), d8);
+		__m256i third = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + offset + 2)), ff);
+
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(first, second), third));
+		if (mask != 0)
+			return offset + count_trailing_zeros(mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i ff = _mm_set1_epi8((char)0xFF);
+	const __m128i d8 = _mm_set1_epi8((char)0xD8);
+
+	for (; offset + 2 + 16 <= size; offset += 16)
+	{
+		__m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset)), ff);
+		__m128i second = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset + 1)), d8);
+		__m128i third = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset + 2)), ff);
+
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(first, second), third));
+		if (mask != 0)
+			return offset + count_trailing_zeros(mask);
+	}
+#endif
+
+	// Scalar tail, or the whole buffer without SIMD (memchr is vectorized by most C libraries)
+	while (offset < last)
+	{
+		const uint8_t* candidate = (const uint8_t*)memchr(data + offset, 0xFF, last - offset);
+		if (candidate == NULL)
+			break;
+
+		offset = (size_t)(candidate - data);
+		if (data[offset + 1] == 0xD8 && data[offset + 2] == 0xFF)
+			return offset;
+
+		offset++;
+	}
+
+	return size;
+}
+
+int is_segment_marker(uint8_t code)
+{
+	// Markers that can follow SOI: APPn, COM, DQT, DHT, DAC, DRI, SOFn and fill bytes
+	return (code >= 0xE0 && code <= 0xEF) || code == 0xFE || code == 0xDB || code == 0xC4 ||
+		code == 0xCC || code == 0xDD || (code >= 0xC0 && code <= 0xCF) || code == 0xFF;
+}
+
+unsigned count_trailing_zeros(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned)index;
+#else
+	return (unsigned)__builtin_ctz(mask);
+#endif
+}
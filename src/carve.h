@@ -0,0 +1,29 @@
+#ifndef _CARVE_H
+#define _CARVE_H
+
+#include <stddef.h>
+#include "loader.h"
+
+struct CarvedImage
+{
+	size_t offset;
+	size_t length;
+	const uint8_t* data;	// Points into the carved buffer
+};
+
+// Called for every image found. jpeg is parsed in place from the buffer and is released
+// after the callback returns.
+typedef void (*CarveCallback)(const struct CarvedImage* image, JPEG* jpeg, void* user_data);
+
+// Finds every JPEG stream in the buffer (concatenated MJPEG frames, raw dumps, ...), checking
+// each SOI candidate with the header parser. Images embedded in a found image (like EXIF
+// thumbnails) are skipped along with it. Returns the number of images found.
+size_t carve_jpegs(const uint8_t* data, size_t size, CarveCallback callback, void* user_data);
+
+// Same as carve_jpegs() on a memory-mapped file, returns (size_t)-1 if the file can't be mapped
+size_t carve_file(const char* filename, CarveCallback callback, void* user_data);
+
+// Offset of the next "0xFF 0xD8 0xFF" sequence at or after start, or size if there is none
+size_t find_start_of_image(const uint8_t* data, size_t size, size_t start);
+
+#endif // _CARVE_H
@@ -0,0 +1,270 @@
+#include "context.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_MIN_CHUNK_SIZE (64 * 1024)
+
+#define align_up(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+struct ArenaChunk
+{
+	struct ArenaChunk* next;
+	size_t capacity;
+	size_t used;
+	uint8_t* data;
+};
+
+struct DecoderContext
+{
+	JPEG jpeg;
+	int in_use;
+	unsigned flags;
+
+	// Error of the last load, which outlives the released image
+	long error_offset;
+	char error_message[MAX_ERROR_MESSAGE_SIZE];
+
+	// Most recently allocated chunk first
+	struct ArenaChunk* chunks;
+};
+
+static struct ArenaChunk* create_chunk(size_t capacity);
+static void reset_arena(DecoderContext* context);
+static void set_error(DecoderContext* context, long offset, const char* message);
+
+DecoderContext* create_decoder_context(void)
+{
+	DecoderContext* context = (DecoderContext*)malloc(sizeof(DecoderContext));
+	if (context == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for decoder context");
+		return NULL;
+	}
+
+	memset(context, 0, sizeof(DecoderContext));
+	return context;
+}
+
+void free_decoder_context(DecoderContext* context)
+{
+	if (context == NULL)
+		return;
+
+	if (context->in_use)
+	{
+		free_jpeg(&context->jpeg);
+	}
+
+	struct ArenaChunk* chunk = context->chunks;
+	while (chunk != NULL)
+	{
+		struct ArenaChunk* next = chunk->next;
+
+		free(chunk->data);
+		free(chunk);
+
+		chunk = next;
+	}
+
+	free(context);
+}
+
+void decoder_set_flags(DecoderContext* context, unsigned flags)
+{
+	assert(context);
+
+	context->flags = flags;
+}
+
+JPEG* decoder_load_jpeg(DecoderContext* context, const char* filename)
+{
+	assert(context);
+
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		set_error(context, 0, "Failed to open file");
+		return NULL;
+	}
+
+	return decoder_load_jpeg_stream(context, fp);
+}
+
+JPEG* decoder_load_jpeg_stream(DecoderContext* context, FILE* fp)
+{
+	assert(context);
+	assert(fp);
+
+	if (context->in_use)
+	{
+		ERROR_LOG("Decoder context is still holding an image");
+		set_error(context, 0, "Decoder context is still holding an image");
+		fclose(fp);
+		return NULL;
+	}
+
+	set_error(context, 0, "");
+
+	JPEG* jpeg = &context->jpeg;
+	memset(jpeg, 0, sizeof(JPEG));
+
+	jpeg->context = context;
+	jpeg->flags = context->flags;
+	context->in_use = 1;
+
+	if (load_jpeg_stream(jpeg, fp) != 0)
+	{
+		set_error(context, jpeg->error_offset, (jpeg->error_message[0] != '\0') ? jpeg->error_message : "Failed to load image");
+		free_jpeg(jpeg);
+		return NULL;
+	}
+
+	return jpeg;
+}
+
+const char* decoder_error(DecoderContext* context, long* offset)
+{
+	assert(context);
+
+	if (context->error_message[0] == '\0')
+		return NULL;
+
+	if (offset != NULL)
+		*offset = context->error_offset;
+
+	return context->error_message;
+}
+
+void* context_alloc(DecoderContext* context, size_t size)
+{
+	assert(context);
+
+	size = align_up(size);
+
+	struct ArenaChunk* chunk = context->chunks;
+	if (chunk == NULL || chunk->capacity - chunk->used < size)
+	{
+		size_t capacity = (chunk == NULL) ? ARENA_MIN_CHUNK_SIZE : chunk->capacity * 2;
+		if (capacity < size)
+			capacity = size;
+
+		struct ArenaChunk* new_chunk = create_chunk(capacity);
+		if (new_chunk == NULL)
+			return NULL;
+
+		new_chunk->next = chunk;
+		context->chunks = new_chunk;
+		chunk = new_chunk;
+	}
+
+	void* ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+void release_context_jpeg(DecoderContext* context)
+{
+	assert(context);
+
+	reset_arena(context);
+
+	memset(&context->jpeg, 0, sizeof(JPEG));
+	context->in_use = 0;
+}
+
+void* jpeg_malloc(JPEG* jpeg, size_t size)
+{
+	assert(jpeg);
+
+	if (jpeg->context)
+		return context_alloc(jpeg->context, size);
+
+	return malloc(size);
+}
+
+void* jpeg_realloc(JPEG* jpeg, void* ptr, size_t old_size, size_t new_size)
+{
+	assert(jpeg);
+
+	if (jpeg->context == NULL)
+		return realloc(ptr, new_size);
+
+	// The old block stays in the arena until the image is released
+	void* new_ptr = context_alloc(jpeg->context, new_size);
+	if (new_ptr != NULL && ptr != NULL)
+		memcpy(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
+
+	return new_ptr;
+}
+
+void jpeg_free(JPEG* jpeg, void* ptr)
+{
+	assert(jpeg);
+
+	// Arena memory is released all at once
+	if (jpeg->context == NULL)
+		free(ptr);
+}
+
+struct ArenaChunk* create_chunk(size_t capacity)
+{
+	struct ArenaChunk* chunk = (struct ArenaChunk*)malloc(sizeof(struct ArenaChunk));
+	if (chunk == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for arena chunk");
+		return NULL;
+	}
+
+	chunk->data = (uint8_t*)malloc(capacity);
+	if (chunk->data == NULL)
+	{
+		ERROR_LOG("Failed to allocate %zu bytes of arena memory", capacity);
+		free(chunk);
+		return NULL;
+	}
+
+	chunk->next = NULL;
+	chunk->capacity = capacity;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+void reset_arena(DecoderContext* context)
+{
+	struct ArenaChunk* chunk = context->chunks;
+	if (chunk == NULL)
+		return;
+
+	if (chunk->next == NULL)
+	{
+		chunk->used = 0;
+		return;
+	}
+
+	// The last image needed more than one chunk, so they are merged into one
+	// big enough to hold all of it, and the next image of that size won't need to grow
+	size_t total_capacity = 0;
+	while (chunk != NULL)
+	{
+		struct ArenaChunk* next = chunk->next;
+		total_capacity += chunk->capacity;
+
+		free(chunk->data);
+		free(chunk);
+
+		chunk = next;
+	}
+
+	context->chunks = create_chunk(total_capacity);
+}
+
+void set_error(DecoderContext* context, long offset, const char* message)
+{
+	context->error_offset = offset;
+	snprintf(context->error_message, sizeof(context->error_message), "%s", message);
+}
@@ -0,0 +1,37 @@
+#ifndef _CONTEXT_H
+#define _CONTEXT_H
+
+#include <stddef.h>
+#include "loader.h"
+
+// Opaque decoder state that is kept alive across images. Every per-image allocation
+// (segment index, table storage, frame and scan headers, coefficient rows, render and output
+// strips, ...) of an image loaded through a context comes from its arena, which only grows
+// when a larger image arrives. Huffman lookup tables aren't part of it, they are shared
+// through the process-wide cache in huffman.h.
+// A context holds at most one image at a time and must not be shared between threads.
+typedef struct DecoderContext DecoderContext;
+
+DecoderContext* create_decoder_context(void);
+void free_decoder_context(DecoderContext* context);
+
+// LoadFlags applied to every image loaded through the context
+void decoder_set_flags(DecoderContext* context, unsigned flags);
+
+// The returned image is owned by the context. Calling free_jpeg() on it hands its memory back.
+JPEG* decoder_load_jpeg(DecoderContext* context, const char* filename);
+JPEG* decoder_load_jpeg_stream(DecoderContext* context, FILE* fp);
+
+// A failed load releases its image right away, so its error is kept by the context until the next
+// load. Returns NULL if the last load succeeded, otherwise the message and the offset it refers to.
+const char* decoder_error(DecoderContext* context, long* offset);
+
+void* context_alloc(DecoderContext* context, size_t size);
+void release_context_jpeg(DecoderContext* context);
+
+// Per-image allocations, served by the image's context if it has one
+void* jpeg_malloc(JPEG* jpeg, size_t size);
+void* jpeg_realloc(JPEG* jpeg, void* ptr, size_t old_size, size_t new_size);
+void jpeg_free(JPEG* jpeg, void* ptr);
+
+#endif // _CONTEXT_H
@@ -0,0 +1,1021 @@
+#include "decoder.h"
+#include "context.h"
+#include "huffman.h"
+#include "arithmetic.h"
+
+#include <memory.h>
+#include <assert.h>
+
+#define MAX_BLOCKS_PER_MCU 10
+
+const uint8_t natural_order[64] =
+{
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+struct ScanComponentState
+{
+	struct FrameComponent* frame_component;
+	struct ComponentCoefficients* coefficients;
+
+	const struct HuffmanDecoder* dc_decoder;
+	const struct HuffmanDecoder* ac_decoder;
+
+	// Arithmetic coding uses the table destinations to select statistics bins
+	uint8_t dc_table;
+	uint8_t ac_table;
+	uint8_t dc_lower;		// Conditioning bounds L and U
+	uint8_t dc_upper;
+	uint8_t ac_kx;
+	uint8_t dc_context;
+
+	int dc_predictor;
+};
+
+struct ScanState
+{
+	JPEG* jpeg;
+	struct ScanHeader* header;
+	struct BitReader reader;
+
+	struct ScanComponentState components[MAX_SCAN_COMPONENTS];
+	unsigned eob_run;
+
+	int arithmetic;
+	struct ArithmeticDecoder arithmetic_decoder;
+	uint8_t dc_statistics[4][ARITHMETIC_DC_STATISTICS];
+	uint8_t ac_statistics[4][ARITHMETIC_AC_STATISTICS];
+	uint8_t fixed_statistics;
+
+	// Blocks of sequential scans that aren't kept are decoded here
+	int16_t scratch[64];
+};
+
+typedef int (*BlockDecoder)(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+
+static int allocate_coefficients(JPEG* jpeg);
+static int check_scan_header(JPEG* jpeg, struct ScanHeader* scan_header, long offset);
+static const struct HuffmanDecoder* get_huffman_decoder(JPEG* jpeg, enum TableClass class, uint8_t destination);
+static uint8_t get_arithmetic_conditioning(JPEG* jpeg, enum TableClass class, uint8_t destination);
+static void reset_arithmetic_statistics(struct ScanState* state);
+
+static uint8_t get_arithmetic_conditioning(JPEG* jpeg, enum TableClass class, uint8_t destination)
+{
+	// Like the other tables, the latest definition wins
+	for (size_t i = jpeg->num_arithmetic_conditionings; i > 0; i--)
+	{
+		struct ArithmeticConditioning* conditioning = jpeg->arithmetic_conditionings + (i - 1);
+		if (conditioning->class == class && conditioning->destination == destination)
+			return conditioning->value;
+	}
+
+	return (class == DCTable) ? DEFAULT_ARITHMETIC_DC_CONDITIONING : DEFAULT_ARITHMETIC_AC_CONDITIONING;
+}
+
+void reset_arithmetic_statistics(struct ScanState* state)
+{
+	// Statistics start over with every scan and restart interval (T.81, F.1.4.1 and F.2.4)
+	memset(state->dc_statistics, 0, sizeof(state->dc_statistics));
+	memset(state->ac_statistics, 0, sizeof(state->ac_statistics));
+	state->fixed_statistics = ARITHMETIC_FIXED_STATE;
+
+	for (size_t i = 0; i < MAX_SCAN_COMPONENTS; i++)
+		state->components[i].dc_context = 0;
+
+	reset_arithmetic_decoder(&state->arithmetic_decoder);
+}
+
+static int decode_block_sequential(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_sequential_dc_only(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_dc_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_dc_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_ac_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_ac_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+
+static int decode_block_arithmetic_sequential(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_arithmetic_dc_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_arithmetic_dc_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_arithmetic_ac_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+static int decode_block_arithmetic_ac_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block);
+
+static int process_restart(struct ScanState* state, unsigned restart_count);
+static int finish_scan(struct ScanState* state);
+
+uint16_t mcus_per_line(const struct FrameHeader* frame_header)
+{
+	unsigned mcu_width = 8 * frame_header->max_sampling_factor.h;
+	return (uint16_t)((frame_header->num_samples + mcu_width - 1) / mcu_width);
+}
+
+uint16_t mcu_lines(const struct FrameHeader* frame_header)
+{
+	unsigned mcu_height = 8 * frame_header->max_sampling_factor.v;
+	return (uint16_t)((frame_header->num_lines + mcu_height - 1) / mcu_height);
+}
+
+int decode_scan(JPEG* jpeg, FILE* fp, struct ScanHeader* scan_header)
+{
+	assert(jpeg);
+	assert(fp);
+	assert(scan_header);
+
+	long offset = ftell(fp);
+
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	uint8_t process = frame_header->encoding & ENCODING_PROCESS_MASK;
+
+	if (process == Lossless || (frame_header->encoding & ENCODING_DCT_MASK) == Differential)
+	{
+		jpeg_error(jpeg, offset, "Lossless and hierarchical scans are not supported");
+		return 1;
+	}
+
+	if (frame_header->num_lines == 0)
+	{
+		jpeg_error(jpeg, offset, "Frames with a height defined by DNL are not supported");
+		return 1;
+	}
+
+	if (check_scan_header(jpeg, scan_header, offset) != 0)
+		return 1;
+
+	// Sequential scans only need somewhere to put each block while validating, progressive
+	// scans build on the coefficients of earlier ones
+	int keep_coefficients = (jpeg->flags & LoadDecodeScans) || process == Progressive;
+	if (keep_coefficients && jpeg->coefficients == NULL && allocate_coefficients(jpeg) != 0)
+		return 1;
+
+	struct ScanState scan_state;
+	struct ScanState* state = &scan_state;
+
+	memset(state, 0, sizeof(struct ScanState));
+	state->jpeg = jpeg;
+	state->header = scan_header;
+	state->arithmetic = (frame_header->encoding & ENCODING_CODING_MASK) == Arithmetic;
+
+	uint8_t ss = scan_header->spectral_select_start;
+	uint8_t ah = scan_header->approx_bit_pos.high;
+
+	for (size_t i = 0; i < scan_header->num_components; i++)
+	{
+		struct ScanComponentState* component = state->components + i;
+		struct ScanComponent* scan_component = scan_header->components + i;
+
+		for (size_t c = 0; c < frame_header->num_components; c++)
+		{
+			if (frame_header->components[c].identifier == scan_component->identifier)
+			{
+				component->frame_component = frame_header->components + c;
+				if (keep_coefficients)
+					component->coefficients = jpeg->coefficients + c;
+			}
+		}
+
+		int needs_dc = (ss == 0 && ah == 0);
+		int needs_ac = (process != Progressive || ss > 0);
+
+		if (state->arithmetic)
+		{
+			component->dc_table = scan_component->table_destination.dc;
+			component->ac_table = scan_component->table_destination.ac;
+
+			if ((needs_dc && component->dc_table > 3) || (needs_ac && component->ac_table > 3))
+			{
+				jpeg_error(jpeg, offset, "Invalid arithmetic table destinations %u/%u", component->dc_table, component->ac_table);
+				return 1;
+			}
+
+			uint8_t dc_conditioning = get_arithmetic_conditioning(jpeg, DCTable, component->dc_table);
+			component->dc_lower = dc_conditioning & 0x0F;
+			component->dc_upper = dc_conditioning >> 4;
+			component->ac_kx = get_arithmetic_conditioning(jpeg, ACTable, component->ac_table);
+
+			continue;
+		}
+
+		if (needs_dc)
+		{
+			component->dc_decoder = get_huffman_decoder(jpeg, DCTable, scan_component->table_destination.dc);
+			if (component->dc_decoder == NULL)
+			{
+				jpeg_error(jpeg, offset, "Scan uses undefined or invalid DC table %u", scan_component->table_destination.dc);
+				return 1;
+			}
+		}
+
+		if (needs_ac)
+		{
+			component->ac_decoder = get_huffman_decoder(jpeg, ACTable, scan_component->table_destination.ac);
+			if (component->ac_decoder == NULL)
+			{
+				jpeg_error(jpeg, offset, "Scan uses undefined or invalid AC table %u", scan_component->table_destination.ac);
+				return 1;
+			}
+		}
+	}
+
+	BlockDecoder decode_block;
+	if (state->arithmetic)
+	{
+		if (process != Progressive)
+			decode_block = decode_block_arithmetic_sequential;
+		else if (ss == 0)
+			decode_block = (ah == 0) ? decode_block_arithmetic_dc_first : decode_block_arithmetic_dc_refine;
+		else
+			decode_block = (ah == 0) ? decode_block_arithmetic_ac_first : decode_block_arithmetic_ac_refine;
+
+		reset_arithmetic_statistics(state);
+	}
+	else if (process != Progressive)
+		decode_block = ((jpeg->flags & LoadDCOnly) && !(jpeg->flags & LoadValidate)) ? decode_block_sequential_dc_only : decode_block_sequential;
+	else if (ss == 0)
+		decode_block = (ah == 0) ? decode_block_dc_first : decode_block_dc_refine;
+	else
+		decode_block = (ah == 0) ? decode_block_ac_first : decode_block_ac_refine;
+
+	init_bit_reader(&state->reader, fp);
+
+	unsigned restart_interval = jpeg->restart_interval;
+	unsigned restart_count = 0;
+	unsigned mcus_left = restart_interval;
+
+	if (scan_header->num_components == 1)
+	{
+		// Non-interleaved scans cover only the blocks of the component itself, not whole MCUs
+		struct ScanComponentState* component = state->components;
+
+		unsigned width = (unsigned)(frame_header->num_samples * component->frame_component->sampling_factor.h + frame_header->max_sampling_factor.h - 1) / frame_header->max_sampling_factor.h;
+		unsigned height = (unsigned)(frame_header->num_lines * component->frame_component->sampling_factor.v + frame_header->max_sampling_factor.v - 1) / frame_header->max_sampling_factor.v;
+		unsigned blocks_x = (width + 7) / 8;
+		unsigned blocks_y = (height + 7) / 8;
+
+		for (unsigned y = 0; y < blocks_y; y++)
+		{
+			for (unsigned x = 0; x < blocks_x; x++)
+			{
+				if (restart_interval != 0 && mcus_left == 0)
+				{
+					if (process_restart(state, restart_count++) != 0)
+						return 1;
+
+					mcus_left = restart_interval;
+				}
+
+				int16_t* block = state->scratch;
+				if (component->coefficients)
+					block = component->coefficients->data + ((size_t)y * component->coefficients->blocks_x + x) * 64;
+
+				if (decode_block(state, component, block) != 0)
+					return 1;
+
+				if (!state->arithmetic && bit_reader_overrun(&state->reader))
+				{
+					jpeg_error(jpeg, state->reader.end_offset, "Entropy-coded data ends before block %u,%u of component %u", x, y, component->frame_component->identifier);
+					return 1;
+				}
+
+				mcus_left--;
+			}
+		}
+	}
+	else
+	{
+		uint16_t mcus_x = mcus_per_line(frame_header);
+		uint16_t mcus_y = mcu_lines(frame_header);
+
+		for (unsigned mcu_y = 0; mcu_y < mcus_y; mcu_y++)
+		{
+			for (unsigned mcu_x = 0; mcu_x < mcus_x; mcu_x++)
+			{
+				if (restart_interval != 0 && mcus_left == 0)
+				{
+					if (process_restart(state, restart_count++) != 0)
+						return 1;
+
+					mcus_left = restart_interval;
+				}
+
+				for (size_t i = 0; i < scan_header->num_components; i++)
+				{
+					struct ScanComponentState* component = state->components + i;
+					unsigned h = component->frame_component->sampling_factor.h;
+					unsigned v = component->frame_component->sampling_factor.v;
+
+					for (unsigned block_y = 0; block_y < v; block_y++)
+					{
+						for (unsigned block_x = 0; block_x < h; block_x++)
+						{
+							int16_t* block = state->scratch;
+							if (component->coefficients)
+							{
+								size_t row = (size_t)mcu_y * v + block_y;
+								size_t column = (size_t)mcu_x * h + block_x;
+								block = component->coefficients->data + (row * component->coefficients->blocks_x + column) * 64;
+							}
+
+							if (decode_block(state, component, block) != 0)
+								return 1;
+						}
+					}
+				}
+
+				if (!state->arithmetic && bit_reader_overrun(&state->reader))
+				{
+					jpeg_error(jpeg, state->reader.end_offset, "Entropy-coded data ends before MCU %u,%u", mcu_x, mcu_y);
+					return 1;
+				}
+
+				mcus_left--;
+			}
+		}
+	}
+
+	return finish_scan(state);
+}
+
+int allocate_coefficients(JPEG* jpeg)
+{
+	struct FrameHeader* frame_header = jpeg->frame_header;
+
+	jpeg->coefficients = (struct ComponentCoefficients*)jpeg_malloc(jpeg, sizeof(struct ComponentCoefficients) * frame_header->num_components);
+	if (jpeg->coefficients == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for coefficients");
+		return 1;
+	}
+
+	memset(jpeg->coefficients, 0, sizeof(struct ComponentCoefficients) * frame_header->num_components);
+
+	uint16_t mcus_x = mcus_per_line(frame_header);
+	uint16_t mcus_y = mcu_lines(frame_header);
+
+	for (size_t c = 0; c < frame_header->num_components; c++)
+	{
+		struct FrameComponent* frame_component = frame_header->components + c;
+		struct ComponentCoefficients* coefficients = jpeg->coefficients + c;
+
+		coefficients->width = (uint16_t)((frame_header->num_samples * frame_component->sampling_factor.h + frame_header->max_sampling_factor.h - 1) / frame_header->max_sampling_factor.h);
+		coefficients->height = (uint16_t)((frame_header->num_lines * frame_component->sampling_factor.v + frame_header->max_sampling_factor.v - 1) / frame_header->max_sampling_factor.v);
+		coefficients->blocks_x = mcus_x * frame_component->sampling_factor.h;
+		coefficients->blocks_y = mcus_y * frame_component->sampling_factor.v;
+
+		size_t size = (size_t)coefficients->blocks_x * coefficients->blocks_y * 64 * sizeof(int16_t);
+		coefficients->data = (int16_t*)jpeg_malloc(jpeg, size);
+		if (coefficients->data == NULL)
+		{
+			ERROR_LOG("Failed to allocate memory for coefficients of component #%zu", c);
+			return 1;
+		}
+
+		memset(coefficients->data, 0, size);
+	}
+
+	return 0;
+}
+
+int check_scan_header(JPEG* jpeg, struct ScanHeader* scan_header, long offset)
+{
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	uint8_t process = frame_header->encoding & ENCODING_PROCESS_MASK;
+
+	uint8_t ss = scan_header->spectral_select_start;
+	uint8_t se = scan_header->spectral_select_end;
+	uint8_t ah = scan_header->approx_bit_pos.high;
+	uint8_t al = scan_header->approx_bit_pos.low;
+
+	unsigned blocks_per_mcu = 0;
+	for (size_t i = 0; i < scan_header->num_components; i++)
+	{
+		struct ScanComponent* scan_component = scan_header->components + i;
+
+		for (size_t j = 0; j < i; j++)
+		{
+			if (scan_header->components[j].identifier == scan_component->identifier)
+			{
+				jpeg_error(jpeg, offset, "Component %u appears twice in scan", scan_component->identifier);
+				return 1;
+			}
+		}
+
+		for (size_t c = 0; c < frame_header->num_components; c++)
+		{
+			if (frame_header->components[c].identifier == scan_component->identifier)
+				blocks_per_mcu += frame_header->components[c].sampling_factor.h * frame_header->components[c].sampling_factor.v;
+		}
+	}
+
+	if (scan_header->num_components > 1 && blocks_per_mcu > MAX_BLOCKS_PER_MCU)
+	{
+		jpeg_error(jpeg, offset, "Scan has %u blocks per MCU", blocks_per_mcu);
+		return 1;
+	}
+
+	if (process != Progressive)
+	{
+		if (ss != 0 || se != 63 || ah != 0 || al != 0)
+		{
+			jpeg_error(jpeg, offset, "Invalid spectral selection %u-%u / approximation %u,%u for sequential scan", ss, se, ah, al);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (se > 63 || ss > se || al > 13 || (ss == 0 && se != 0) || (ss > 0 && scan_header->num_components != 1))
+	{
+		jpeg_error(jpeg, offset, "Invalid spectral selection %u-%u for progressive scan", ss, se);
+		return 1;
+	}
+
+	if (ah != 0 && ah != al + 1)
+	{
+		jpeg_error(jpeg, offset, "Invalid successive approximation %u,%u", ah, al);
+		return 1;
+	}
+
+	return 0;
+}
+
+const struct HuffmanDecoder* get_huffman_decoder(JPEG* jpeg, enum TableClass class, uint8_t destination)
+{
+	// Tables can be redefined between scans, so the latest definition wins
+	for (size_t i = jpeg->num_huffman_tables; i > 0; i--)
+	{
+		struct HuffmanTable* table = jpeg->huffman_tables + (i - 1);
+		if (table->class != class || table->destination != destination)
+			continue;
+
+		if (table->decoder == NULL || !table->decoder->valid)
+			return NULL;
+
+		return table->decoder;
+	}
+
+	return NULL;
+}
+
+static int decode_block_sequential(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	struct BitReader* reader = &state->reader;
+
+	int s = decode_huffman(reader, component->dc_decoder);
+	if (s < 0 || s > 15)
+	{
+		jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid DC code");
+		return 1;
+	}
+
+	component->dc_predictor += receive_extend(reader, s);
+
+	memset(block, 0, sizeof(int16_t) * 64);
+	block[0] = (int16_t)component->dc_predictor;
+
+	for (int k = 1; k < 64; k++)
+	{
+		int rs = decode_huffman(reader, component->ac_decoder);
+		if (rs < 0)
+		{
+			jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid AC code");
+			return 1;
+		}
+
+		int r = rs >> 4;
+		s = rs & 15;
+
+		if (s == 0)
+		{
+			if (r != 15)
+				break;	// End of block
+
+			k += 15;
+			continue;
+		}
+
+		k += r;
+		if (k > 63)
+		{
+			jpeg_error(state->jpeg, bit_reader_offset(reader), "AC coefficients run past the end of the block");
+			return 1;
+		}
+
+		block[natural_order[k]] = (int16_t)receive_extend(reader, s);
+	}
+
+	return 0;
+}
+
+int decode_block_sequential_dc_only(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	struct BitReader* reader = &state->reader;
+
+	int s = decode_huffman(reader, component->dc_decoder);
+	if (s < 0 || s > 15)
+	{
+		jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid DC code");
+		return 1;
+	}
+
+	component->dc_predictor += receive_extend(reader, s);
+	block[0] = (int16_t)component->dc_predictor;
+
+	// AC codes still have to be walked, but their magnitude bits are skipped unread
+	for (int k = 1; k < 64; k++)
+	{
+		int rs = decode_huffman(reader, component->ac_decoder);
+		if (rs < 0)
+		{
+			jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid AC code");
+			return 1;
+		}
+
+		s = rs & 15;
+		if (s == 0)
+		{
+			if ((rs >> 4) != 15)
+				break;	// End of block
+
+			k += 15;
+			continue;
+		}
+
+		k += rs >> 4;
+		peek_bits(reader, s);
+		skip_bits(reader, s);
+	}
+
+	return 0;
+}
+
+int decode_block_dc_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	struct BitReader* reader = &state->reader;
+
+	int s = decode_huffman(reader, component->dc_decoder);
+	if (s < 0 || s > 15)
+	{
+		jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid DC code");
+		return 1;
+	}
+
+	component->dc_predictor += receive_extend(reader, s);
+	block[0] = (int16_t)(component->dc_predictor * (1 << state->header->approx_bit_pos.low));
+
+	return 0;
+}
+
+int decode_block_dc_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	(void)component;
+
+	if (get_bit(&state->reader))
+		block[0] |= (int16_t)(1 << state->header->approx_bit_pos.low);
+
+	return 0;
+}
+
+int decode_block_ac_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	struct BitReader* reader = &state->reader;
+
+	if (state->eob_run > 0)
+	{
+		state->eob_run--;
+		return 0;
+	}
+
+	uint8_t al = state->header->approx_bit_pos.low;
+	uint8_t se = state->header->spectral_select_end;
+
+	for (int k = state->header->spectral_select_start; k <= se; k++)
+	{
+		int rs = decode_huffman(reader, component->ac_decoder);
+		if (rs < 0)
+		{
+			jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid AC code");
+			return 1;
+		}
+
+		int r = rs >> 4;
+		int s = rs & 15;
+
+		if (s == 0)
+		{
+			if (r < 15)
+			{
+				state->eob_run = (1u << r) - 1;
+				if (r > 0)
+					state->eob_run += get_bits(reader, r);
+
+				break;
+			}
+
+			k += 15;
+			continue;
+		}
+
+		k += r;
+		if (k > se)
+		{
+			jpeg_error(state->jpeg, bit_reader_offset(reader), "AC coefficients run past the spectral selection");
+			return 1;
+		}
+
+		block[natural_order[k]] = (int16_t)(receive_extend(reader, s) * (1 << al));
+	}
+
+	return 0;
+}
+
+int decode_block_ac_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	struct BitReader* reader = &state->reader;
+
+	uint8_t se = state->header->spectral_select_end;
+	int positive = 1 << state->header->approx_bit_pos.low;
+	int negative = -1 * positive;
+
+	int k = state->header->spectral_select_start;
+
+	// Coefficients that are already non-zero get a correction bit whenever they are passed (T.81, G.1.2.3)
+	if (state->eob_run == 0)
+	{
+		for (; k <= se; k++)
+		{
+			int rs = decode_huffman(reader, component->ac_decoder);
+			if (rs < 0)
+			{
+				jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid AC code");
+				return 1;
+			}
+
+			int r = rs >> 4;
+			int s = rs & 15;
+
+			if (s != 0)
+			{
+				if (s != 1)
+				{
+					jpeg_error(state->jpeg, bit_reader_offset(reader), "Invalid AC refinement magnitude %d", s);
+					return 1;
+				}
+
+				s = get_bit(reader) ? positive : negative;
+			}
+			else if (r != 15)
+			{
+				state->eob_run = 1u << r;
+				if (r > 0)
+					state->eob_run += get_bits(reader, r);
+
+				break;
+			}
+
+			do
+			{
+				int16_t* coefficient = block + natural_order[k];
+				if (*coefficient != 0)
+				{
+					if (get_bit(reader) && (*coefficient & positive) == 0)
+						*coefficient += (int16_t)((*coefficient >= 0) ? positive : negative);
+				}
+				else
+				{
+					if (r == 0)
+						break;
+
+					r--;
+				}
+
+				k++;
+			} while (k <= se);
+
+			if (s != 0)
+			{
+				if (k > se)
+				{
+					jpeg_error(state->jpeg, bit_reader_offset(reader), "AC coefficients run past the spectral selection");
+					return 1;
+				}
+
+				block[natural_order[k]] = (int16_t)s;
+			}
+		}
+	}
+
+	if (state->eob_run > 0)
+	{
+		for (; k <= se; k++)
+		{
+			int16_t* coefficient = block + natural_order[k];
+			if (*coefficient != 0 && get_bit(reader) && (*coefficient & positive) == 0)
+				*coefficient += (int16_t)((*coefficient >= 0) ? positive : negative);
+		}
+
+		state->eob_run--;
+	}
+
+	return 0;
+}
+
+// Decodes a DC difference (T.81, F.1.4.4.1 and F.2.4.1) and updates the conditioning category
+static int decode_arithmetic_dc_difference(struct ScanState* state, struct ScanComponentState* component, int* difference)
+{
+	struct ArithmeticDecoder* decoder = &state->arithmetic_decoder;
+	struct BitReader* reader = &state->reader;
+	uint8_t* statistics = state->dc_statistics[component->dc_table];
+	uint8_t* bin = statistics + component->dc_context;
+
+	if (decode_arithmetic(decoder, reader, bin) == 0)
+	{
+		component->dc_context = 0;
+		*difference = 0;
+		return 0;
+	}
+
+	int sign = decode_arithmetic(decoder, reader, bin + 1);
+	bin += 2 + sign;
+
+	// Magnitude category (Figure F.23)
+	int magnitude = decode_arithmetic(decoder, reader, bin);
+	if (magnitude != 0)
+	{
+		bin = statistics + 20;
+		while (decode_arithmetic(decoder, reader, bin))
+		{
+			magnitude <<= 1;
+			if (magnitude == 0x8000)
+			{
+				jpeg_error(state->jpeg, bit_reader_offset(reader), "Arithmetic-coded DC difference out of range");
+				return 1;
+			}
+
+			bin++;
+		}
+	}
+
+	// Conditioning category for the next difference (F.1.4.4.1.2)
+	if (magnitude < (1 << component->dc_lower) >> 1)
+		component->dc_context = 0;
+	else if (magnitude > (1 << component->dc_upper) >> 1)
+		component->dc_context = (uint8_t)(12 + sign * 4);
+	else
+		component->dc_context = (uint8_t)(4 + sign * 4);
+
+	// Magnitude bits (Figure F.24)
+	int value = magnitude;
+	bin += 14;
+	while (magnitude >>= 1)
+	{
+		if (decode_arithmetic(decoder, reader, bin))
+			value |= magnitude;
+	}
+
+	value += 1;
+	*difference = sign ? -value : value;
+
+	return 0;
+}
+
+// Decodes the AC coefficients ss to se of a block (T.81, F.1.4.4.2 and F.2.4.2)
+static int decode_arithmetic_ac_coefficients(struct ScanState* state, struct ScanComponentState* component, int16_t* block, int ss, int se, int al)
+{
+	struct ArithmeticDecoder* decoder = &state->arithmetic_decoder;
+	struct BitReader* reader = &state->reader;
+	uint8_t* statistics = state->ac_statistics[component->ac_table];
+
+	for (int k = ss; k <= se; k++)
+	{
+		uint8_t* bin = statistics + 3 * (k - 1);
+		if (decode_arithmetic(decoder, reader, bin))
+			break;	// End of block
+
+		while (decode_arithmetic(decoder, reader, bin + 1) == 0)
+		{
+			bin += 3;
+			if (++k > se)
+			{
+				jpeg_error(state->jpeg, bit_reader_offset(reader), "AC coefficients run past the spectral selection");
+				return 1;
+			}
+		}
+
+		int sign = decode_arithmetic(decoder, reader, &state->fixed_statistics);
+		bin += 2;
+
+		int magnitude = decode_arithmetic(decoder, reader, bin);
+		if (magnitude != 0 && decode_arithmetic(decoder, reader, bin))
+		{
+			magnitude <<= 1;
+			bin = statistics + ((k <= component->ac_kx) ? 189 : 217);
+
+			while (decode_arithmetic(decoder, reader, bin))
+			{
+				magnitude <<= 1;
+				if (magnitude == 0x8000)
+				{
+					jpeg_error(state->jpeg, bit_reader_offset(reader), "Arithmetic-coded AC coefficient out of range");
+					return 1;
+				}
+
+				bin++;
+			}
+		}
+
+		int value = magnitude;
+		bin += 14;
+		while (magnitude >>= 1)
+		{
+			if (decode_arithmetic(decoder, reader, bin))
+				value |= magnitude;
+		}
+
+		value += 1;
+		block[natural_order[k]] = (int16_t)((sign ? -value : value) * (1 << al));
+	}
+
+	return 0;
+}
+
+int decode_block_arithmetic_sequential(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	int difference;
+	if (decode_arithmetic_dc_difference(state, component, &difference) != 0)
+		return 1;
+
+	component->dc_predictor += difference;
+
+	memset(block, 0, sizeof(int16_t) * 64);
+	block[0] = (int16_t)component->dc_predictor;
+
+	return decode_arithmetic_ac_coefficients(state, component, block, 1, 63, 0);
+}
+
+int decode_block_arithmetic_dc_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	int difference;
+	if (decode_arithmetic_dc_difference(state, component, &difference) != 0)
+		return 1;
+
+	component->dc_predictor += difference;
+	block[0] = (int16_t)(component->dc_predictor * (1 << state->header->approx_bit_pos.low));
+
+	return 0;
+}
+
+int decode_block_arithmetic_dc_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	(void)component;
+
+	if (decode_arithmetic(&state->arithmetic_decoder, &state->reader, &state->fixed_statistics))
+		block[0] |= (int16_t)(1 << state->header->approx_bit_pos.low);
+
+	return 0;
+}
+
+int decode_block_arithmetic_ac_first(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	return decode_arithmetic_ac_coefficients(
+		state, component, block,
+		state->header->spectral_select_start, state->header->spectral_select_end,
+		state->header->approx_bit_pos.low
+	);
+}
+
+int decode_block_arithmetic_ac_refine(struct ScanState* state, struct ScanComponentState* component, int16_t* block)
+{
+	struct ArithmeticDecoder* decoder = &state->arithmetic_decoder;
+	struct BitReader* reader = &state->reader;
+	uint8_t* statistics = state->ac_statistics[component->ac_table];
+
+	uint8_t se = state->header->spectral_select_end;
+	int positive = 1 << state->header->approx_bit_pos.low;
+	int negative = -1 * positive;
+
+	// End of block of the previous stage, no EOB decision is coded before it (T.81, G.1.3.3)
+	int previous_end = se;
+	while (previous_end > 0 && block[natural_order[previous_end]] == 0)
+		previous_end--;
+
+	for (int k = state->header->spectral_select_start; k <= se; k++)
+	{
+		uint8_t* bin = statistics + 3 * (k - 1);
+		if (k > previous_end && decode_arithmetic(decoder, reader, bin))
+			break;	// End of block
+
+		for (;;)
+		{
+			int16_t* coefficient = block + natural_order[k];
+			if (*coefficient != 0)
+			{
+				if (decode_arithmetic(decoder, reader, bin + 2))
+					*coefficient += (int16_t)((*coefficient >= 0) ? positive : negative);
+
+				break;
+			}
+
+			if (decode_arithmetic(decoder, reader, bin + 1))
+			{
+				*coefficient = (int16_t)(decode_arithmetic(decoder, reader, &state->fixed_statistics) ? negative : positive);
+				break;
+			}
+
+			bin += 3;
+			if (++k > se)
+			{
+				jpeg_error(state->jpeg, bit_reader_offset(reader), "AC coefficients run past the spectral selection");
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int process_restart(struct ScanState* state, unsigned restart_count)
+{
+	struct BitReader* reader = &state->reader;
+
+	// The arithmetic decoder reads ahead and may run into the marker, so only Huffman-coded
+	// intervals can be checked for truncation or extra data
+	if (!state->arithmetic && bit_reader_overrun(reader))
+	{
+		jpeg_error(state->jpeg, reader->end_offset, "Restart interval #%u ends early", restart_count);
+		return 1;
+	}
+
+	long data_offset = bit_reader_offset(reader);
+	size_t skipped = skip_to_marker(reader);
+
+	if (!state->arithmetic && skipped > 0 && (state->jpeg->flags & LoadValidate))
+	{
+		jpeg_error(state->jpeg, data_offset, "%zu bytes of extra data before restart marker", skipped);
+		return 1;
+	}
+
+	uint8_t expected = 0xD0 + (restart_count & 7);
+	if (reader->marker != expected)
+	{
+		jpeg_error(state->jpeg, reader->end_offset, "Expected RST%u marker, found 0xFF 0x%02X", restart_count & 7, reader->marker);
+		return 1;
+	}
+
+	consume_marker(reader);
+
+	for (size_t i = 0; i < MAX_SCAN_COMPONENTS; i++)
+		state->components[i].dc_predictor = 0;
+
+	state->eob_run = 0;
+
+	if (state->arithmetic)
+		reset_arithmetic_statistics(state);
+
+	return 0;
+}
+
+int finish_scan(struct ScanState* state)
+{
+	struct BitReader* reader = &state->reader;
+
+	long data_offset = bit_reader_offset(reader);
+	size_t skipped = skip_to_marker(reader);
+
+	if (!state->arithmetic && skipped > 0 && (state->jpeg->flags & LoadValidate))
+	{
+		jpeg_error(state->jpeg, data_offset, "%zu bytes of extra data after the last MCU", skipped);
+		return 1;
+	}
+
+	// Some encoders end the last interval with a restart marker as well
+	while (reader->marker >= 0xD0 && reader->marker <= 0xD7)
+	{
+		if (state->jpeg->flags & LoadValidate)
+		{
+			jpeg_error(state->jpeg, reader->end_offset, "Unexpected RST%u marker after the last MCU", reader->marker & 7);
+			return 1;
+		}
+
+		consume_marker(reader);
+		skip_to_marker(reader);
+	}
+
+	if (reader->marker == 0)
+	{
+		jpeg_error(state->jpeg, reader->end_offset, "File ends inside entropy-coded data");
+		return 1;
+	}
+
+	if (finish_bit_reader(reader) != 0)
+	{
+		ERROR_LOG("Failed to seek past entropy-coded data");
+		return 1;
+	}
+
+	return 0;
+}
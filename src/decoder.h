@@ -0,0 +1,16 @@
+#ifndef _DECODER_H
+#define _DECODER_H
+
+#include "loader.h"
+
+// Maps the zig-zag index of a coefficient to its position in the 8x8 block
+extern const uint8_t natural_order[64];
+
+// Geometry of the frame in MCUs
+uint16_t mcus_per_line(const struct FrameHeader* frame_header);
+uint16_t mcu_lines(const struct FrameHeader* frame_header);
+
+// Decodes the entropy-coded data following a scan header and leaves the stream at the next marker
+int decode_scan(JPEG* jpeg, FILE* fp, struct ScanHeader* scan_header);
+
+#endif // _DECODER_H
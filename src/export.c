@@ -0,0 +1,265 @@
+#include "export.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <memory.h>
+#include <assert.h>
+
+#define PREAMBLE_SIZE (COEFFICIENT_FILE_MAGIC_SIZE + 2 + sizeof(uint32_t))
+
+struct HeaderBuffer
+{
+	char* data;
+	size_t size;
+	size_t used;
+};
+
+static int format_header(JPEG* jpeg, struct HeaderBuffer* header, size_t data_offset);
+static int append_header(struct HeaderBuffer* header, const char* format, ...);
+static const char* process_name(uint8_t encoding);
+static int write_plane(const struct ComponentCoefficients* coefficients, FILE* fp);
+
+static size_t align_offset(size_t offset)
+{
+	return (offset + COEFFICIENT_FILE_ALIGNMENT - 1) & ~(size_t)(COEFFICIENT_FILE_ALIGNMENT - 1);
+}
+
+static size_t plane_size(const struct ComponentCoefficients* coefficients)
+{
+	return (size_t)coefficients->blocks_x * coefficients->blocks_y * 64 * sizeof(int16_t);
+}
+
+int export_coefficients(JPEG* jpeg, FILE* fp)
+{
+	assert(jpeg);
+	assert(fp);
+
+	if (jpeg->frame_header == NULL || jpeg->coefficients == NULL)
+	{
+		ERROR_LOG("No decoded coefficients to export, the image has to be loaded with LoadDecodeScans");
+		return 1;
+	}
+
+	struct HeaderBuffer header;
+	header.size = 512 + (size_t)jpeg->frame_header->num_components * 1024;
+	header.used = 0;
+	header.data = (char*)malloc(header.size);
+	if (header.data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for coefficient file header");
+		return 1;
+	}
+
+	// Plane offsets are part of the header, so its length is settled by growing it
+	// until the text fits in front of the first plane
+	size_t data_offset = COEFFICIENT_FILE_ALIGNMENT;
+	for (;;)
+	{
+		if (format_header(jpeg, &header, data_offset) != 0)
+		{
+			free(header.data);
+			return 1;
+		}
+
+		size_t needed = PREAMBLE_SIZE + header.used + 1;
+		if (needed <= data_offset)
+			break;
+
+		data_offset = align_offset(needed);
+	}
+
+	// Pad with spaces and terminate with a newline like .npy does
+	uint32_t header_length = (uint32_t)(data_offset - PREAMBLE_SIZE);
+	uint8_t preamble[PREAMBLE_SIZE];
+	memcpy(preamble, COEFFICIENT_FILE_MAGIC, COEFFICIENT_FILE_MAGIC_SIZE);
+	preamble[6] = COEFFICIENT_FILE_VERSION_MAJOR;
+	preamble[7] = COEFFICIENT_FILE_VERSION_MINOR;
+	preamble[8] = header_length & 0xFF;
+	preamble[9] = (header_length >> 8) & 0xFF;
+	preamble[10] = (header_length >> 16) & 0xFF;
+	preamble[11] = (header_length >> 24) & 0xFF;
+
+	int result = 0;
+	if (fwrite(preamble, sizeof(uint8_t), PREAMBLE_SIZE, fp) != PREAMBLE_SIZE ||
+		fwrite(header.data, sizeof(char), header.used, fp) != header.used)
+	{
+		result = 1;
+	}
+
+	for (size_t i = header.used; result == 0 && i < header_length; i++)
+	{
+		if (fputc((i == header_length - 1) ? '\n' : ' ', fp) == EOF)
+			result = 1;
+	}
+
+	free(header.data);
+
+	size_t offset = data_offset;
+	for (uint8_t c = 0; result == 0 && c < jpeg->frame_header->num_components; c++)
+	{
+		const struct ComponentCoefficients* coefficients = jpeg->coefficients + c;
+
+		for (; offset < align_offset(offset); offset++)
+		{
+			if (fputc(0, fp) == EOF)
+				result = 1;
+		}
+
+		if (result == 0 && write_plane(coefficients, fp) != 0)
+			result = 1;
+
+		offset += plane_size(coefficients);
+	}
+
+	if (result != 0)
+	{
+		ERROR_LOG("Failed to write coefficient file");
+		return 1;
+	}
+
+	return 0;
+}
+
+int export_coefficients_file(const char* jpeg_filename, const char* output_filename)
+{
+	assert(jpeg_filename);
+	assert(output_filename);
+
+	JPEG* jpeg = load_jpeg_with_flags(jpeg_filename, LoadDecodeScans);
+	if (jpeg == NULL)
+	{
+		ERROR_LOG("Failed to load %s", jpeg_filename);
+		return 1;
+	}
+
+	FILE* fp = fopen(output_filename, "wb");
+	if (fp == NULL)
+	{
+		ERROR_LOG("Failed to open %s", output_filename);
+		free_jpeg(jpeg);
+		return 1;
+	}
+
+	int result = export_coefficients(jpeg, fp);
+
+	if (fclose(fp) != 0)
+	{
+		ERROR_LOG("Failed to close %s", output_filename);
+		result = 1;
+	}
+
+	free_jpeg(jpeg);
+	return result;
+}
+
+int format_header(JPEG* jpeg, struct HeaderBuffer* header, size_t data_offset)
+{
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	header->used = 0;
+
+	int result = append_header(
+		header,
+		"{'version': (%d, %d), 'width': %u, 'height': %u, 'precision': %u, 'process': '%s', "
+		"'arithmetic': %s, 'differential': %s, 'max_sampling_factor': (%u, %u), 'dtype': '<i2', 'components': [",
+		COEFFICIENT_FILE_VERSION_MAJOR, COEFFICIENT_FILE_VERSION_MINOR,
+		frame_header->num_samples, frame_header->num_lines, frame_header->precision,
+		process_name(frame_header->encoding),
+		(frame_header->encoding & ENCODING_CODING_MASK) == Arithmetic ? "True" : "False",
+		(frame_header->encoding & ENCODING_DCT_MASK) == NonDifferential ? "False" : "True",
+		frame_header->max_sampling_factor.h, frame_header->max_sampling_factor.v
+	);
+
+	size_t offset = data_offset;
+	for (uint8_t c = 0; result == 0 && c < frame_header->num_components; c++)
+	{
+		const struct FrameComponent* component = frame_header->components + c;
+		const struct ComponentCoefficients* coefficients = jpeg->coefficients + c;
+
+		offset = align_offset(offset);
+
+		result |= append_header(
+			header,
+			"%s{'id': %u, 'sampling_factor': (%u, %u), 'width': %u, 'height': %u, "
+			"'shape': (%u, %u, 8, 8), 'offset': %zu, 'quantization_table': ",
+			(c == 0) ? "" : ", ",
+			component->identifier, component->sampling_factor.h, component->sampling_factor.v,
+			coefficients->width, coefficients->height,
+			coefficients->blocks_y, coefficients->blocks_x, offset
+		);
+
+		const struct QuantizationTable* table = find_quantization_table(jpeg, component->quantization_table);
+		if (table == NULL)
+		{
+			result |= append_header(header, "None}");
+		}
+		else
+		{
+			uint16_t values[64];
+			get_quantization_values(table, values);
+
+			for (int i = 0; result == 0 && i < 64; i++)
+				result |= append_header(header, "%s%u", (i == 0) ? "(" : ", ", values[i]);
+
+			result |= append_header(header, ")}");
+		}
+
+		offset += plane_size(coefficients);
+	}
+
+	result |= append_header(header, "]}");
+	return result;
+}
+
+int append_header(struct HeaderBuffer* header, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(header->data + header->used, header->size - header->used, format, args);
+	va_end(args);
+
+	if (written < 0 || (size_t)written >= header->size - header->used)
+	{
+		ERROR_LOG("Coefficient file header too long");
+		return 1;
+	}
+
+	header->used += written;
+	return 0;
+}
+
+const char* process_name(uint8_t encoding)
+{
+	switch (encoding & ENCODING_PROCESS_MASK)
+	{
+	case Baseline:		return "baseline";
+	case Extended:		return "extended";
+	case Progressive:	return "progressive";
+	default:			return "lossless";
+	}
+}
+
+int write_plane(const struct ComponentCoefficients* coefficients, FILE* fp)
+{
+	size_t size = plane_size(coefficients);
+
+	// The header declares '<i2', so only big-endian hosts have to swap the coefficients
+	const uint16_t byte_order = 1;
+	if (*(const uint8_t*)&byte_order == 1)
+		return fwrite(coefficients->data, sizeof(uint8_t), size, fp) != size;
+
+	uint16_t buffer[1024];
+	const uint16_t* data = (const uint16_t*)coefficients->data;
+	size_t count = size / sizeof(int16_t);
+
+	for (size_t i = 0; i < count; i += 1024)
+	{
+		size_t chunk = (count - i < 1024) ? count - i : 1024;
+		for (size_t j = 0; j < chunk; j++)
+			buffer[j] = bswap_16(data[i + j]);
+
+		if (fwrite(buffer, sizeof(uint16_t), chunk, fp) != chunk)
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _EXPORT_H
+#define _EXPORT_H
+
+#include "loader.h"
+
+// Coefficient files start with a fixed preamble, similar to .npy:
+//   6 bytes  magic "\x93JDCT\0"
+//   1 byte   major version, 1 byte minor version
+//   4 bytes  header length (little endian)
+// followed by an ASCII header in Python literal syntax describing the frame geometry,
+// quantization tables (natural order) and the absolute offset of every component plane.
+// The header is padded so that the planes start on 64 byte boundaries.
+// Planes are little endian int16 with shape (blocks_y, blocks_x, 8, 8), coefficients
+// are in natural order and not dequantized.
+#define COEFFICIENT_FILE_MAGIC "\x93JDCT"
+#define COEFFICIENT_FILE_MAGIC_SIZE 6
+#define COEFFICIENT_FILE_VERSION_MAJOR 1
+#define COEFFICIENT_FILE_VERSION_MINOR 0
+#define COEFFICIENT_FILE_ALIGNMENT 64
+
+// The image must have been loaded with LoadDecodeScans
+int export_coefficients(JPEG* jpeg, FILE* fp);
+int export_coefficients_file(const char* jpeg_filename, const char* output_filename);
+
+#endif // _EXPORT_H
@@ -0,0 +1,314 @@
+#include "hash.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <math.h>
+#include <assert.h>
+
+#ifndef M_PI
+	#define M_PI 3.14159265358979323846
+#endif
+
+static float* build_dc_thumbnail(JPEG* jpeg, size_t* width, size_t* height);
+static int load_dc_values(JPEG* jpeg, size_t index, float* dc_values);
+static int resample(const float* input, size_t input_width, size_t input_height, float* output, size_t output_width, size_t output_height);
+static void resample_line(const float* input, size_t input_length, size_t input_stride, float* output, size_t output_length, size_t output_stride);
+static uint64_t compute_phash(const float* thumbnail);
+static uint64_t compute_dhash(const float* thumbnail);
+static int compare_floats(const void* a, const void* b);
+
+int hash_jpeg(JPEG* jpeg, struct ImageHash* hash)
+{
+	assert(jpeg);
+	assert(hash);
+
+	memset(hash, 0, sizeof(struct ImageHash));
+
+	size_t width;
+	size_t height;
+	float* thumbnail = build_dc_thumbnail(jpeg, &width, &height);
+	if (thumbnail == NULL)
+		return 1;
+
+	float phash_input[PHASH_SIZE * PHASH_SIZE];
+	float dhash_input[DHASH_WIDTH * DHASH_HEIGHT];
+
+	if (resample(thumbnail, width, height, phash_input, PHASH_SIZE, PHASH_SIZE) != 0 ||
+		resample(thumbnail, width, height, dhash_input, DHASH_WIDTH, DHASH_HEIGHT) != 0)
+	{
+		free(thumbnail);
+		return 1;
+	}
+
+	hash->phash = compute_phash(phash_input);
+	hash->dhash = compute_dhash(dhash_input);
+
+	free(thumbnail);
+	return 0;
+}
+
+int hash_jpeg_file(const char* filename, struct ImageHash* hash)
+{
+	assert(filename);
+
+	JPEG* jpeg = load_jpeg_with_flags(filename, LoadDecodeScans | LoadDCOnly);
+	if (jpeg == NULL)
+	{
+		ERROR_LOG("Failed to load %s", filename);
+		return 1;
+	}
+
+	int result = hash_jpeg(jpeg, hash);
+	free_jpeg(jpeg);
+
+	return result;
+}
+
+unsigned hash_distance(uint64_t a, uint64_t b)
+{
+	uint64_t difference = a ^ b;
+
+	unsigned count = 0;
+	for (; difference != 0; count++)
+		difference &= difference - 1;
+
+	return count;
+}
+
+float* build_dc_thumbnail(JPEG* jpeg, size_t* width, size_t* height)
+{
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	if (frame_header == NULL || jpeg->coefficients == NULL)
+	{
+		ERROR_LOG("No decoded coefficients to hash, the image has to be loaded with LoadDecodeScans");
+		return NULL;
+	}
+
+	// One sample per block of the first component, without the padding to whole MCUs
+	struct ComponentCoefficients* luma = jpeg->coefficients;
+	*width = ((size_t)luma->width + 7) / 8;
+	*height = ((size_t)luma->height + 7) / 8;
+
+	if (*width == 0 || *height == 0)
+	{
+		ERROR_LOG("Cannot hash an empty image");
+		return NULL;
+	}
+
+	size_t num_blocks = (size_t)luma->blocks_x * luma->blocks_y;
+	float* thumbnail = (float*)malloc(sizeof(float) * *width * *height);
+	float* dc_values = (float*)malloc(sizeof(float) * num_blocks);
+
+	if (thumbnail == NULL || dc_values == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for thumbnail");
+		free(thumbnail);
+		free(dc_values);
+		return NULL;
+	}
+
+	int rgb = frame_header->num_components == 3 &&
+		frame_header->components[0].identifier == 'R' &&
+		frame_header->components[1].identifier == 'G' &&
+		frame_header->components[2].identifier == 'B';
+
+	if (load_dc_values(jpeg, 0, dc_values) != 0)
+	{
+		free(thumbnail);
+		free(dc_values);
+		return NULL;
+	}
+
+	for (size_t y = 0; y < *height; y++)
+		memcpy(thumbnail + y * *width, dc_values + y * luma->blocks_x, sizeof(float) * *width);
+
+	if (rgb)
+	{
+		// Rec. 601 luma from the block averages, which is exact as the transform is linear
+		static const float weights[3] = { 0.299f, 0.587f, 0.114f };
+
+		for (size_t i = 0; i < *width * *height; i++)
+			thumbnail[i] *= weights[0];
+
+		for (size_t c = 1; c < 3; c++)
+		{
+			struct ComponentCoefficients* coefficients = jpeg->coefficients + c;
+
+			float* component_values = (float*)realloc(dc_values, sizeof(float) * coefficients->blocks_x * coefficients->blocks_y);
+			if (component_values == NULL)
+			{
+				ERROR_LOG("Failed to allocate memory for thumbnail");
+				free(thumbnail);
+				free(dc_values);
+				return NULL;
+			}
+
+			dc_values = component_values;
+			if (load_dc_values(jpeg, c, dc_values) != 0)
+			{
+				free(thumbnail);
+				free(dc_values);
+				return NULL;
+			}
+
+			// Components with other sampling factors cover the same area with more or fewer blocks
+			unsigned h = frame_header->components[c].sampling_factor.h;
+			unsigned v = frame_header->components[c].sampling_factor.v;
+			unsigned luma_h = frame_header->components[0].sampling_factor.h;
+			unsigned luma_v = frame_header->components[0].sampling_factor.v;
+
+			for (size_t y = 0; y < *height; y++)
+			{
+				size_t block_y = y * v / luma_v;
+				for (size_t x = 0; x < *width; x++)
+				{
+					size_t block_x = x * h / luma_h;
+					thumbnail[y * *width + x] += weights[c] * dc_values[block_y * coefficients->blocks_x + block_x];
+				}
+			}
+		}
+	}
+
+	free(dc_values);
+	return thumbnail;
+}
+
+int load_dc_values(JPEG* jpeg, size_t index, float* dc_values)
+{
+	struct FrameComponent* component = jpeg->frame_header->components + index;
+	struct ComponentCoefficients* coefficients = jpeg->coefficients + index;
+
+	const struct QuantizationTable* table = find_quantization_table(jpeg, component->quantization_table);
+	if (table == NULL)
+	{
+		ERROR_LOG("Component %u uses undefined quantization table %u", component->identifier, component->quantization_table);
+		return 1;
+	}
+
+	uint16_t values[64];
+	get_quantization_values(table, values);
+
+	// The DC coefficient is eight times the block average
+	float scale = values[0] / 8.0f;
+
+	size_t num_blocks = (size_t)coefficients->blocks_x * coefficients->blocks_y;
+	for (size_t i = 0; i < num_blocks; i++)
+	{
+		float value = coefficients->data[i * 64] * scale + 128.0f;
+		dc_values[i] = (value < 0.0f) ? 0.0f : (value > 255.0f) ? 255.0f : value;
+	}
+
+	return 0;
+}
+
+int resample(const float* input, size_t input_width, size_t input_height, float* output, size_t output_width, size_t output_height)
+{
+	float* rows = (float*)malloc(sizeof(float) * output_width * input_height);
+	if (rows == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for thumbnail");
+		return 1;
+	}
+
+	for (size_t y = 0; y < input_height; y++)
+		resample_line(input + y * input_width, input_width, 1, rows + y * output_width, output_width, 1);
+
+	for (size_t x = 0; x < output_width; x++)
+		resample_line(rows + x, input_height, output_width, output + x, output_height, output_width);
+
+	free(rows);
+	return 0;
+}
+
+// Box filter that averages the input area covered by every output sample, or repeats input
+// samples when enlarging
+void resample_line(const float* input, size_t input_length, size_t input_stride, float* output, size_t output_length, size_t output_stride)
+{
+	double step = (double)input_length / output_length;
+
+	for (size_t i = 0; i < output_length; i++)
+	{
+		double start = i * step;
+		double end = (i + 1) * step;
+
+		double sum = 0.0;
+		for (size_t j = (size_t)start; j < input_length && j < end; j++)
+		{
+			double covered = ((j + 1 < end) ? j + 1 : end) - ((j > start) ? j : start);
+			sum += covered * input[j * input_stride];
+		}
+
+		output[i * output_stride] = (float)(sum / step);
+	}
+}
+
+uint64_t compute_phash(const float* thumbnail)
+{
+	// Only the 8x8 lowest frequencies of the 2D DCT-II are needed
+	float basis[8][PHASH_SIZE];
+	for (int u = 0; u < 8; u++)
+	{
+		for (int x = 0; x < PHASH_SIZE; x++)
+			basis[u][x] = (float)cos((2 * x + 1) * u * M_PI / (2.0 * PHASH_SIZE));
+	}
+
+	float rows[PHASH_SIZE][8];
+	for (int y = 0; y < PHASH_SIZE; y++)
+	{
+		for (int u = 0; u < 8; u++)
+		{
+			float sum = 0.0f;
+			for (int x = 0; x < PHASH_SIZE; x++)
+				sum += thumbnail[y * PHASH_SIZE + x] * basis[u][x];
+
+			rows[y][u] = sum;
+		}
+	}
+
+	float frequencies[64];
+	for (int v = 0; v < 8; v++)
+	{
+		for (int u = 0; u < 8; u++)
+		{
+			float sum = 0.0f;
+			for (int y = 0; y < PHASH_SIZE; y++)
+				sum += rows[y][u] * basis[v][y];
+
+			frequencies[v * 8 + u] = sum;
+		}
+	}
+
+	float sorted[64];
+	memcpy(sorted, frequencies, sizeof(sorted));
+	qsort(sorted, 64, sizeof(float), compare_floats);
+
+	float median = (sorted[31] + sorted[32]) / 2.0f;
+
+	uint64_t hash = 0;
+	for (int i = 0; i < 64; i++)
+		hash = (hash << 1) | (frequencies[i] > median);
+
+	return hash;
+}
+
+uint64_t compute_dhash(const float* thumbnail)
+{
+	uint64_t hash = 0;
+
+	for (int y = 0; y < DHASH_HEIGHT; y++)
+	{
+		const float* row = thumbnail + y * DHASH_WIDTH;
+		for (int x = 0; x < DHASH_WIDTH - 1; x++)
+			hash = (hash << 1) | (row[x + 1] > row[x]);
+	}
+
+	return hash;
+}
+
+int compare_floats(const void* a, const void* b)
+{
+	float x = *(const float*)a;
+	float y = *(const float*)b;
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,28 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stdint.h>
+#include "loader.h"
+
+#define PHASH_SIZE 32
+#define DHASH_WIDTH 9
+#define DHASH_HEIGHT 8
+
+// Perceptual hashes, first bit in the most significant position
+struct ImageHash
+{
+	uint64_t phash;		// Low 8x8 DCT frequencies of a 32x32 thumbnail, compared to their median
+	uint64_t dhash;		// Horizontal gradient signs of a 9x8 thumbnail
+};
+
+// Hashes the luma of the image from a 1/8 scale thumbnail made of the dequantized DC coefficients,
+// without any IDCT or color conversion. The image must have been loaded with LoadDecodeScans,
+// LoadDCOnly is enough. For images that are neither grayscale, YCbCr nor RGB the first
+// component stands in for the luma.
+int hash_jpeg(JPEG* jpeg, struct ImageHash* hash);
+int hash_jpeg_file(const char* filename, struct ImageHash* hash);
+
+// Number of differing bits
+unsigned hash_distance(uint64_t a, uint64_t b);
+
+#endif // _HASH_H
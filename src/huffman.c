@@ -0,0 +1,216 @@
+#include "huffman.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#ifdef JPEGDISSECT_HAVE_PTHREAD
+	#include <pthread.h>
+
+	static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	#define LOCK_CACHE() pthread_mutex_lock(&cache_mutex)
+	#define UNLOCK_CACHE() pthread_mutex_unlock(&cache_mutex)
+#else
+	#define LOCK_CACHE()
+	#define UNLOCK_CACHE()
+#endif
+
+#define HUFFMAN_CACHE_BUCKETS 64
+
+struct HuffmanCacheEntry
+{
+	struct HuffmanDecoder decoder;	// Has to stay the first member, decoders are cast back to their entry
+
+	uint64_t hash;
+	uint8_t num_codes[16];
+	size_t num_values;
+
+	size_t references;
+	struct HuffmanCacheEntry* next;
+};
+
+static struct HuffmanCacheEntry* cache_buckets[HUFFMAN_CACHE_BUCKETS];
+static size_t cache_entries = 0;
+
+static void build_huffman_decoder(const uint8_t num_codes[16], struct HuffmanDecoder* decoder);
+static uint64_t hash_huffman_table(const uint8_t num_codes[16], const uint8_t* values, size_t num_values);
+static int evict_unused_entry(void);
+static void remove_entry(struct HuffmanCacheEntry* entry);
+
+const struct HuffmanDecoder* acquire_huffman_decoder(const uint8_t num_codes[16], const uint8_t* values)
+{
+	assert(num_codes);
+
+	size_t num_values = 0;
+	for (int i = 0; i < 16; i++)
+		num_values += num_codes[i];
+
+	if (num_values > sizeof(((struct HuffmanDecoder*)NULL)->values))
+		return NULL;
+
+	uint64_t hash = hash_huffman_table(num_codes, values, num_values);
+	struct HuffmanCacheEntry** bucket = cache_buckets + (hash % HUFFMAN_CACHE_BUCKETS);
+
+	LOCK_CACHE();
+
+	for (struct HuffmanCacheEntry* entry = *bucket; entry != NULL; entry = entry->next)
+	{
+		if (entry->hash != hash || entry->num_values != num_values)
+			continue;
+
+		if (memcmp(entry->num_codes, num_codes, 16) != 0 || memcmp(entry->decoder.values, values, num_values) != 0)
+			continue;
+
+		entry->references++;
+		UNLOCK_CACHE();
+
+		return &entry->decoder;
+	}
+
+	// Tables that are in use can't be evicted, so the cache can grow past its size
+	// while more than HUFFMAN_CACHE_SIZE distinct tables are alive
+	if (cache_entries >= HUFFMAN_CACHE_SIZE)
+		evict_unused_entry();
+
+	struct HuffmanCacheEntry* entry = (struct HuffmanCacheEntry*)malloc(sizeof(struct HuffmanCacheEntry));
+	if (entry == NULL)
+	{
+		UNLOCK_CACHE();
+
+		ERROR_LOG("Failed to allocate memory for huffman decoder");
+		return NULL;
+	}
+
+	memset(&entry->decoder, 0, sizeof(struct HuffmanDecoder));
+	memcpy(entry->decoder.values, values, num_values);
+	build_huffman_decoder(num_codes, &entry->decoder);
+
+	entry->hash = hash;
+	memcpy(entry->num_codes, num_codes, 16);
+	entry->num_values = num_values;
+	entry->references = 1;
+
+	entry->next = *bucket;
+	*bucket = entry;
+	cache_entries++;
+
+	UNLOCK_CACHE();
+
+	return &entry->decoder;
+}
+
+void release_huffman_decoder(const struct HuffmanDecoder* decoder)
+{
+	if (decoder == NULL)
+		return;
+
+	struct HuffmanCacheEntry* entry = (struct HuffmanCacheEntry*)decoder;
+
+	LOCK_CACHE();
+
+	assert(entry->references > 0);
+	entry->references--;
+
+	if (entry->references == 0 && cache_entries > HUFFMAN_CACHE_SIZE)
+		remove_entry(entry);
+
+	UNLOCK_CACHE();
+}
+
+void clear_huffman_cache(void)
+{
+	LOCK_CACHE();
+
+	while (evict_unused_entry() == 0)
+		;
+
+	UNLOCK_CACHE();
+}
+
+void build_huffman_decoder(const uint8_t num_codes[16], struct HuffmanDecoder* decoder)
+{
+	int32_t code = 0;
+	size_t num_values = 0;
+
+	decoder->valid = 1;
+
+	for (int length = 1; length <= 16; length++)
+	{
+		uint8_t count = num_codes[length - 1];
+
+		decoder->value_offset[length] = (int32_t)num_values - code;
+		decoder->max_code[length] = -1;
+
+		if (count > 0)
+		{
+			if (length <= HUFFMAN_LOOKUP_BITS && code + count <= (1 << length))
+			{
+				for (int i = 0; i < count; i++)
+				{
+					int32_t first = (code + i) << (HUFFMAN_LOOKUP_BITS - length);
+					int32_t span = 1 << (HUFFMAN_LOOKUP_BITS - length);
+
+					memset(decoder->lookup_length + first, length, span);
+					memset(decoder->lookup_value + first, decoder->values[num_values + i], span);
+				}
+			}
+
+			code += count;
+			num_values += count;
+			decoder->max_code[length] = code - 1;
+		}
+
+		// Codes of each length have to fit into that length without the all-ones code (T.81, C.2)
+		if (code >= (1 << length))
+		{
+			decoder->valid = 0;
+			return;
+		}
+
+		code <<= 1;
+	}
+}
+
+uint64_t hash_huffman_table(const uint8_t num_codes[16], const uint8_t* values, size_t num_values)
+{
+	// FNV-1a over BITS followed by HUFFVAL
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (int i = 0; i < 16; i++)
+		hash = (hash ^ num_codes[i]) * 0x100000001B3ULL;
+
+	for (size_t i = 0; i < num_values; i++)
+		hash = (hash ^ values[i]) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+int evict_unused_entry(void)
+{
+	for (size_t i = 0; i < HUFFMAN_CACHE_BUCKETS; i++)
+	{
+		for (struct HuffmanCacheEntry* entry = cache_buckets[i]; entry != NULL; entry = entry->next)
+		{
+			if (entry->references == 0)
+			{
+				remove_entry(entry);
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+void remove_entry(struct HuffmanCacheEntry* entry)
+{
+	struct HuffmanCacheEntry** link = cache_buckets + (entry->hash % HUFFMAN_CACHE_BUCKETS);
+	while (*link != entry)
+		link = &(*link)->next;
+
+	*link = entry->next;
+	cache_entries--;
+
+	free(entry);
+}
@@ -0,0 +1,70 @@
+#ifndef _HUFFMAN_H
+#define _HUFFMAN_H
+
+#include "loader.h"
+#include "bitreader.h"
+
+#define HUFFMAN_LOOKUP_BITS 9
+
+// Decoding tables derived from a DHT table (ITU T.81, Annex C and F.2.2.3).
+// Codes of up to HUFFMAN_LOOKUP_BITS bits are decoded with a single lookup.
+struct HuffmanDecoder
+{
+	uint8_t lookup_length[1 << HUFFMAN_LOOKUP_BITS];	// 0 if the code is longer
+	uint8_t lookup_value[1 << HUFFMAN_LOOKUP_BITS];
+
+	int32_t max_code[17];		// Largest code of each length, -1 if there are none
+	int32_t value_offset[17];
+	uint8_t values[256];
+
+	int valid;					// 0 if the code lengths don't describe a valid code (T.81, C.2)
+};
+
+// Decoders are cached process-wide and shared between all tables with the same BITS/HUFFVAL
+// contents, so they must not be modified. Every acquired decoder has to be released again.
+// Unused decoders stay cached until the cache is full or it is cleared.
+#define HUFFMAN_CACHE_SIZE 256
+
+const struct HuffmanDecoder* acquire_huffman_decoder(const uint8_t num_codes[16], const uint8_t* values);
+void release_huffman_decoder(const struct HuffmanDecoder* decoder);
+void clear_huffman_cache(void);
+
+// Returns the decoded value, or -1 for a code that isn't in the table
+static inline int decode_huffman(struct BitReader* reader, const struct HuffmanDecoder* decoder)
+{
+	uint32_t look = peek_bits(reader, 16);
+
+	int length = decoder->lookup_length[look >> (16 - HUFFMAN_LOOKUP_BITS)];
+	if (length != 0)
+	{
+		skip_bits(reader, length);
+		return decoder->lookup_value[look >> (16 - HUFFMAN_LOOKUP_BITS)];
+	}
+
+	for (length = HUFFMAN_LOOKUP_BITS + 1; length <= 16; length++)
+	{
+		int32_t code = (int32_t)(look >> (16 - length));
+		if (code <= decoder->max_code[length])
+		{
+			skip_bits(reader, length);
+			return decoder->values[code + decoder->value_offset[length]];
+		}
+	}
+
+	return -1;
+}
+
+// Reads an s-bit magnitude and sign-extends it (T.81, F.2.2.1)
+static inline int receive_extend(struct BitReader* reader, int s)
+{
+	if (s == 0)
+		return 0;
+
+	int value = (int)get_bits(reader, s);
+	if (value < (1 << (s - 1)))
+		value += (int)(-1 * (1 << s)) + 1;
+
+	return value;
+}
+
+#endif // _HUFFMAN_H
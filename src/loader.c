@@ -1,15 +1,25 @@
 #include "loader.h"
+#include "context.h"
+#include "decoder.h"
+#include "validate.h"
+#include "huffman.h"
 
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <math.h>
 
 #define MAX_QUANTIZATION_TABLES 255
 #define MAX_HUFFMAN_TABLES 255
 
+#define END_OF_IMAGE 2
+#define SCAN_CHUNK_SIZE 4096
+
 #define memzero(buffer, size) memset(buffer, 0, size)
 
+static void release_jpeg_data(JPEG* jpeg);
 static int load_segment(JPEG* jpeg, FILE* fp);
 
 static int load_quantization_table(JPEG* jpeg, FILE* fp);
@@ -18,7 +28,12 @@ static int load_start_of_frame(JPEG* jpeg, FILE* fp, uint8_t type);
 static int load_start_of_scan(JPEG* jpeg, FILE* fp);
 
 static int load_scan_data(JPEG* jpeg, FILE* fp, struct ScanComponent* scan_component);
+static int skip_entropy_coded_data(JPEG* jpeg, FILE* fp);
+
+static int index_segment(JPEG* jpeg, uint8_t marker, long offset, size_t length);
 
+static int load_arithmetic_conditioning(JPEG* jpeg, FILE* fp);
+static int load_restart_interval(JPEG* jpeg, FILE* fp);
 static int load_rst_segment(JPEG* jpeg, FILE* fp, uint8_t n);
 static int load_app_segment(JPEG* jpeg, FILE* fp, uint8_t n);
 
@@ -26,29 +41,186 @@ static int load_app0_segment(JPEG* jpeg, FILE* fp);
 
 JPEG* load_jpeg(const char* filename)
 {
-	FILE* fp = fopen(filename, "r+b");
+	return load_jpeg_with_flags(filename, LoadIndexOnly);
+}
+
+JPEG* load_jpeg_with_flags(const char* filename, unsigned flags)
+{
+	FILE* fp = fopen(filename, "rb");
 	if (fp == NULL)
 	{
 		return NULL;
 	}
 
 	JPEG* jpeg = (JPEG*)malloc(sizeof(JPEG));
+	if (jpeg == NULL)
+	{
+		fclose(fp);
+		return NULL;
+	}
+
 	memzero(jpeg, sizeof(JPEG));
+	jpeg->flags = flags;
 
-	while (!feof(fp))
+	if (load_jpeg_stream(jpeg, fp) != 0)
 	{
-		if (load_segment(jpeg, fp) != 0)
-		{
-			ERROR_LOG("Segment loading failed");
-			free_jpeg(jpeg);
+		free_jpeg(jpeg);
+		return NULL;
+	}
+
+	return jpeg;
+}
+
+JPEG* load_jpeg_memory(const uint8_t* data, size_t size)
+{
+	return load_jpeg_memory_with_flags(data, size, LoadIndexOnly);
+}
+
+JPEG* load_jpeg_memory_with_flags(const uint8_t* data, size_t size, unsigned flags)
+{
+	FILE* fp = open_memory_file(data, size);
+	if (fp == NULL)
+	{
+		return NULL;
+	}
+
+	JPEG* jpeg = (JPEG*)malloc(sizeof(JPEG));
+	if (jpeg == NULL)
+	{
+		fclose(fp);
+		return NULL;
+	}
+
+	memzero(jpeg, sizeof(JPEG));
+	jpeg->flags = flags;
+
+	if (load_jpeg_stream(jpeg, fp) != 0)
+	{
+		free_jpeg(jpeg);
+		return NULL;
+	}
+
+	return jpeg;
+}
 
+FILE* open_memory_file(const uint8_t* data, size_t size)
+{
+	assert(data);
+
+#if defined(_MSC_VER)
+	// No fmemopen() here, so the buffer is copied into a temporary file instead
+	FILE* fp = tmpfile();
+	if (fp == NULL || fwrite(data, sizeof(uint8_t), size, fp) != size || fseek(fp, 0, SEEK_SET) != 0)
+	{
+		ERROR_LOG("Failed to copy buffer into temporary file");
+		if (fp)
 			fclose(fp);
-			return NULL;
+
+		return NULL;
+	}
+#else
+	FILE* fp = fmemopen((void*)data, size, "rb");
+	if (fp == NULL)
+	{
+		ERROR_LOG("Failed to open buffer as stream");
+		return NULL;
+	}
+#endif
+
+	return fp;
+}
+
+int load_jpeg_stream(JPEG* jpeg, FILE* fp)
+{
+	assert(jpeg);
+	assert(fp);
+
+	// The file stays open so segment payloads can be read on demand
+	jpeg->fp = fp;
+
+	// Every image starts with its only SOI marker
+	long start_offset = ftell(fp);
+	jpeg->start_offset = start_offset;
+
+	uint8_t start_of_image[2];
+	if (fread(start_of_image, sizeof(uint8_t), sizeof(start_of_image), fp) != sizeof(start_of_image) ||
+		start_of_image[0] != 0xFF || start_of_image[1] != 0xD8)
+	{
+		jpeg_error(jpeg, start_offset, "Missing SOI marker");
+		return 1;
+	}
+
+	DEBUG_LOG("SOI marker encountered");
+
+	for (;;)
+	{
+		long offset = ftell(fp);
+
+		int result = load_segment(jpeg, fp);
+		if (result == END_OF_IMAGE)
+			break;
+
+		if (result != 0)
+		{
+			if (jpeg->error_message[0] == '\0')
+			{
+				jpeg_error(jpeg, offset, "Segment loading failed");
+			}
+
+			return 1;
 		}
 	}
 
-	fclose(fp);
-	return jpeg;
+	if ((jpeg->flags & LoadValidate) && validate_image_complete(jpeg, ftell(fp)) != 0)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+void jpeg_error(JPEG* jpeg, long offset, const char* format, ...)
+{
+	assert(jpeg);
+
+	char message[MAX_ERROR_MESSAGE_SIZE];
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	ERROR_LOG("%s (offset %ld)", message, offset);
+
+	if (jpeg->error_message[0] != '\0')
+		return;
+
+	jpeg->error_offset = offset;
+	memcpy(jpeg->error_message, message, sizeof(message));
+}
+
+int reload_jpeg(JPEG* jpeg, unsigned flags)
+{
+	assert(jpeg);
+
+	FILE* fp = jpeg->fp;
+	if (fp == NULL || fseek(fp, jpeg->start_offset, SEEK_SET) != 0)
+	{
+		ERROR_LOG("Failed to rewind image stream");
+		return 1;
+	}
+
+	struct DecoderContext* context = jpeg->context;
+	flags |= jpeg->flags;
+
+	// Images in a decoder context keep their arena, the new parse allocates from it again
+	release_jpeg_data(jpeg);
+
+	memzero(jpeg, sizeof(JPEG));
+	jpeg->context = context;
+	jpeg->flags = flags;
+
+	return load_jpeg_stream(jpeg, fp);
 }
 
 void free_jpeg(JPEG* jpeg)
@@ -56,15 +228,41 @@ void free_jpeg(JPEG* jpeg)
 	if (jpeg == NULL)
 		return;
 
+	if (jpeg->fp)
+	{
+		fclose(jpeg->fp);
+		jpeg->fp = NULL;
+	}
+
+	release_jpeg_data(jpeg);
+
+	// Images loaded through a decoder context hand their memory back to it
+	if (jpeg->context)
+	{
+		release_context_jpeg(jpeg->context);
+		return;
+	}
+
+	free(jpeg);
+}
+
+void release_jpeg_data(JPEG* jpeg)
+{
+	if (jpeg->segments)
+	{
+		jpeg_free(jpeg, jpeg->segments);
+		jpeg->segments = NULL;
+	}
+
 	if (jpeg->app0)
 	{
 		if (jpeg->app0->thumbnail_data)
 		{
-			free(jpeg->app0->thumbnail_data);
+			jpeg_free(jpeg, jpeg->app0->thumbnail_data);
 			jpeg->app0->thumbnail_data = NULL;
 		}
 
-		free(jpeg->app0);
+		jpeg_free(jpeg, jpeg->app0);
 		jpeg->app0 = NULL;
 	}
 
@@ -74,12 +272,12 @@ void free_jpeg(JPEG* jpeg)
 		{
 			if (jpeg->quantization_tables[i].data)
 			{
-				free(jpeg->quantization_tables[i].data);
+				jpeg_free(jpeg, jpeg->quantization_tables[i].data);
 				jpeg->quantization_tables[i].data = NULL;
 			}
 		}
 
-		free(jpeg->quantization_tables);
+		jpeg_free(jpeg, jpeg->quantization_tables);
 		jpeg->quantization_tables = NULL;
 	}
 
@@ -87,59 +285,69 @@ void free_jpeg(JPEG* jpeg)
 	{
 		for (size_t i = 0; i < jpeg->num_huffman_tables; i++)
 		{
-			for (size_t j = 0; j < 16; j++)
-			{
-				if (jpeg->huffman_tables[i].codes[j])
-				{
-					free(jpeg->huffman_tables[i].codes[j]);
-					jpeg->huffman_tables[i].codes[j] = NULL;
-				}
-			}
+			release_huffman_decoder(jpeg->huffman_tables[i].decoder);
+			jpeg->huffman_tables[i].decoder = NULL;
 		}
 
-		free(jpeg->huffman_tables);
+		jpeg_free(jpeg, jpeg->huffman_tables);
 		jpeg->huffman_tables = NULL;
 	}
 
+	if (jpeg->arithmetic_conditionings)
+	{
+		jpeg_free(jpeg, jpeg->arithmetic_conditionings);
+		jpeg->arithmetic_conditionings = NULL;
+	}
+
+	if (jpeg->coefficients)
+	{
+		for (size_t i = 0; i < jpeg->frame_header->num_components; i++)
+		{
+			jpeg_free(jpeg, jpeg->coefficients[i].data);
+			jpeg->coefficients[i].data = NULL;
+		}
+
+		jpeg_free(jpeg, jpeg->coefficients);
+		jpeg->coefficients = NULL;
+	}
+
 	if (jpeg->frame_header)
 	{
 		if (jpeg->frame_header->components)
 		{
-			free(jpeg->frame_header->components);
+			jpeg_free(jpeg, jpeg->frame_header->components);
 			jpeg->frame_header->components = NULL;
 		}
 
-		free(jpeg->frame_header);
+		jpeg_free(jpeg, jpeg->frame_header);
 		jpeg->frame_header = NULL;
 	}
 
-	if (jpeg->scan_header)
+	if (jpeg->scan_headers)
 	{
-		if (jpeg->scan_header->components)
+		for (size_t i = 0; i < jpeg->num_scan_headers; i++)
 		{
-			free(jpeg->scan_header->components);
-			jpeg->scan_header->components = NULL;
+			jpeg_free(jpeg, jpeg->scan_headers[i].components);
+			jpeg->scan_headers[i].components = NULL;
 		}
 
-		free(jpeg->scan_header);
-		jpeg->scan_header = NULL;
+		jpeg_free(jpeg, jpeg->scan_headers);
+		jpeg->scan_headers = NULL;
 	}
 
 	if (jpeg->scans)
 	{
 		for (size_t i = 0; i < jpeg->num_scans; i++)
 		{
-			free(jpeg->scans[i].data);
+			jpeg_free(jpeg, jpeg->scans[i].data);
 			jpeg->scans[i].data = NULL;
 			jpeg->scans[i].scan_component = NULL;
 			jpeg->scans[i].frame_component = NULL;
 		}
 
-		free(jpeg->scans);
+		jpeg_free(jpeg, jpeg->scans);
 		jpeg->scans = NULL;
 	}
-
-	free(jpeg);
 }
 
 int load_segment(JPEG* jpeg, FILE* fp)
@@ -147,32 +355,83 @@ int load_segment(JPEG* jpeg, FILE* fp)
 	uint8_t segment_marker[2];
 	size_t segment_marker_size = sizeof(segment_marker);
 
+	long marker_offset = ftell(fp);
 	if (fread(segment_marker, sizeof(uint8_t), segment_marker_size, fp) != segment_marker_size)
 	{
-		ERROR_LOG("Marker terminated unexpectedly");
+		jpeg_error(jpeg, marker_offset, "File ends before EOI marker");
 		return 1;
 	}
 
 	if (segment_marker[0] != 0xFF)
 	{
-		ERROR_LOG("Ill-formatted marker");
+		jpeg_error(jpeg, marker_offset, "Ill-formatted marker");
 		return 1;
 	}
 
-	// Handle special APPn/RSTn markers
-	if (segment_marker[1] >= 0xD0 && segment_marker[1] <= 0xD7)
+	// Any number of 0xFF fill bytes may precede a marker
+	while (segment_marker[1] == 0xFF)
 	{
-		if (load_rst_segment(jpeg, fp, segment_marker[1] | 0x0F) != 0)
+		if (fread(segment_marker + 1, sizeof(uint8_t), sizeof(uint8_t), fp) != sizeof(uint8_t))
 		{
+			jpeg_error(jpeg, ftell(fp), "Marker terminated unexpectedly");
 			return 1;
 		}
 	}
-	else if ((segment_marker[1] & 0xF0) == 0xE0)
+
+	// Markers without a length field
+	if (segment_marker[1] >= 0xD0 && segment_marker[1] <= 0xD7)
+	{
+		return load_rst_segment(jpeg, fp, segment_marker[1] & 0x0F);
+	}
+
+	switch (segment_marker[1])
 	{
-		if (load_app_segment(jpeg, fp, segment_marker[1] & 0x0F) != 0)
-		{
-			return 1;
-		}
+	case 0xD8:	// Start of image, only valid as the first marker
+		jpeg_error(jpeg, marker_offset, "SOI marker inside the image");
+		return 1;
+
+	case 0xD9:	// End of image
+		DEBUG_LOG("EOI marker encountered");
+		return END_OF_IMAGE;
+
+	case 0x01:	// TEM
+		DEBUG_LOG("TEM marker encountered");
+		return 0;
+	}
+
+	// Every other segment is indexed by its length field before it is handled, and
+	// the stream is moved past it afterwards so handlers never have to consume all of it
+	long offset = ftell(fp);
+
+	uint16_t length;
+	if (fread(&length, sizeof(uint8_t), sizeof(uint16_t), fp) != sizeof(uint16_t))
+	{
+		jpeg_error(jpeg, offset, "Failed to read length of segment 0xFF 0x%02X", segment_marker[1]);
+		return 1;
+	}
+
+	length = bswap_16(length);
+	if (length < sizeof(uint16_t))
+	{
+		jpeg_error(jpeg, offset, "Invalid length %u of segment 0xFF 0x%02X", length, segment_marker[1]);
+		return 1;
+	}
+
+	if (index_segment(jpeg, segment_marker[1], offset + sizeof(uint16_t), length - sizeof(uint16_t)) != 0)
+	{
+		return 1;
+	}
+
+	if (fseek(fp, offset, SEEK_SET) != 0)
+	{
+		jpeg_error(jpeg, offset, "Failed to seek in file");
+		return 1;
+	}
+
+	int result = 0;
+	if ((segment_marker[1] & 0xF0) == 0xE0)
+	{
+		result = load_app_segment(jpeg, fp, segment_marker[1] & 0x0F);
 	}
 	else
 	{
@@ -182,27 +441,83 @@ int load_segment(JPEG* jpeg, FILE* fp)
 		case 0xC5: case 0xC6: case 0xC7:
 		case 0xC9: case 0xCA: case 0xCB: 
 		case 0xCD: case 0xCE: case 0xCF:
-			return load_start_of_frame(jpeg, fp, segment_marker[1] & 0x0F);
+			result = load_start_of_frame(jpeg, fp, segment_marker[1] & 0x0F);
+			break;
 
 		case 0xC4:
-			return load_huffman_table(jpeg, fp);
+			result = load_huffman_table(jpeg, fp);
+			break;
 
-		case 0xD8:	// Start of image
-			DEBUG_LOG("SOI marker encountered");
+		case 0xCC:
+			result = load_arithmetic_conditioning(jpeg, fp);
 			break;
 
 		case 0xDA:
+			if ((jpeg->flags & LoadTablesOnly) && !(jpeg->flags & LoadValidate))
+			{
+				DEBUG_LOG("SOS encountered, stopping after the tables");
+				return END_OF_IMAGE;
+			}
+
+			// The scan handler also skips the entropy-coded data, so it leaves the stream where it wants it
 			return load_start_of_scan(jpeg, fp);
 
 		case 0xDB:	// Quantization table
-			return load_quantization_table(jpeg, fp);
+			result = load_quantization_table(jpeg, fp);
+			break;
+
+		case 0xDD:
+			result = load_restart_interval(jpeg, fp);
+			break;
 
 		default:
-			ERROR_LOG("Unimplemented marker 0xFF 0x%02X", segment_marker[1]);
+			DEBUG_LOG("Skipping segment 0xFF 0x%02X (%u bytes)", segment_marker[1], length);
+			break;
+		}
+	}
+
+	if (result != 0)
+		return result;
+
+	if (fseek(fp, offset + length, SEEK_SET) != 0)
+	{
+		jpeg_error(jpeg, offset + length, "Failed to seek past segment 0xFF 0x%02X", segment_marker[1]);
+		return 1;
+	}
+
+	return 0;
+}
+
+int index_segment(JPEG* jpeg, uint8_t marker, long offset, size_t length)
+{
+	assert(jpeg);
+
+	if (jpeg->num_segments == jpeg->segment_capacity)
+	{
+		size_t new_capacity = (jpeg->segment_capacity == 0) ? 16 : jpeg->segment_capacity * 2;
+
+		struct Segment* segments = (struct Segment*)jpeg_realloc(
+			jpeg, jpeg->segments,
+			sizeof(struct Segment) * jpeg->segment_capacity,
+			sizeof(struct Segment) * new_capacity
+		);
+		if (segments == NULL)
+		{
+			ERROR_LOG("Failed to allocate memory for segment index");
 			return 1;
 		}
+
+		jpeg->segments = segments;
+		jpeg->segment_capacity = new_capacity;
 	}
 
+	struct Segment* segment = jpeg->segments + jpeg->num_segments;
+	jpeg->num_segments++;
+
+	segment->marker = marker;
+	segment->offset = offset;
+	segment->length = length;
+
 	return 0;
 }
 
@@ -215,7 +530,7 @@ int load_quantization_table(JPEG* jpeg, FILE* fp)
 
 	if (jpeg->quantization_tables == NULL)
 	{
-		jpeg->quantization_tables = (struct QuantizationTable*)malloc(sizeof(struct QuantizationTable) * MAX_QUANTIZATION_TABLES);
+		jpeg->quantization_tables = (struct QuantizationTable*)jpeg_malloc(jpeg, sizeof(struct QuantizationTable) * MAX_QUANTIZATION_TABLES);
 		if (jpeg->quantization_tables == NULL)
 		{
 			ERROR_LOG("Failed to allocate memory for quantization tables");
@@ -224,10 +539,12 @@ int load_quantization_table(JPEG* jpeg, FILE* fp)
 	}
 
 
+	long offset = ftell(fp);
+
 	uint16_t total_length;
 	if (fread(&total_length, sizeof(uint8_t), sizeof(uint16_t), fp) != sizeof(uint16_t))
 	{
-		ERROR_LOG("Failed to read length of quantization tables");
+		jpeg_error(jpeg, ftell(fp), "Failed to read length of quantization tables");
 		return 1;
 	}
 
@@ -236,13 +553,20 @@ int load_quantization_table(JPEG* jpeg, FILE* fp)
 
 	while (read_length < total_length)
 	{
+		if (jpeg->num_quantization_tables == MAX_QUANTIZATION_TABLES)
+		{
+			jpeg_error(jpeg, offset, "Too many quantization tables");
+			return 1;
+		}
+
 		struct QuantizationTable* current_table = jpeg->quantization_tables + jpeg->num_quantization_tables;
+		memzero(current_table, sizeof(struct QuantizationTable));
 		jpeg->num_quantization_tables++;
 
 		uint8_t meta_info;
 		if (fread(&meta_info, sizeof(uint8_t), sizeof(uint8_t), fp) != sizeof(uint8_t))
 		{
-			ERROR_LOG("Failed to read quantization table #%zu meta info", jpeg->num_quantization_tables);
+			jpeg_error(jpeg, ftell(fp), "Failed to read quantization table #%zu meta info", jpeg->num_quantization_tables);
 			return 1;
 		}
 
@@ -251,6 +575,12 @@ int load_quantization_table(JPEG* jpeg, FILE* fp)
 		current_table->precision = ((meta_info >> 4) == 0) ? sizeof(uint8_t) : sizeof(uint16_t);
 		current_table->destination = meta_info & 0x0F;
 
+		if ((jpeg->flags & LoadValidate) && ((meta_info >> 4) > 1 || current_table->destination > 3))
+		{
+			jpeg_error(jpeg, offset, "Invalid quantization table precision/destination 0x%02X", meta_info);
+			return 1;
+		}
+
 		size_t table_length = current_table->precision * 64;
 
 		DEBUG_LOG(
@@ -263,7 +593,7 @@ int load_quantization_table(JPEG* jpeg, FILE* fp)
 			current_table->destination
 		);
 
-		current_table->data = (uint8_t*)malloc(table_length);
+		current_table->data = (uint8_t*)jpeg_malloc(jpeg, table_length);
 		if (current_table->data == NULL)
 		{
 			ERROR_LOG("Failed to allocate memory for quantization table #%zu data", jpeg->num_quantization_tables);
@@ -272,13 +602,19 @@ int load_quantization_table(JPEG* jpeg, FILE* fp)
 
 		if (fread(current_table->data, sizeof(uint8_t), table_length, fp) != table_length)
 		{
-			ERROR_LOG("Failed to read quantization table #%zu data", jpeg->num_quantization_tables);
+			jpeg_error(jpeg, ftell(fp), "Failed to read quantization table #%zu data", jpeg->num_quantization_tables);
 			return 1;
 		}
 
 		read_length += table_length;
 	}
 
+	if ((jpeg->flags & LoadValidate) && read_length != total_length)
+	{
+		jpeg_error(jpeg, offset, "DQT length %u doesn't match its tables (%zu bytes)", total_length, read_length);
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -291,7 +627,7 @@ int load_huffman_table(JPEG* jpeg, FILE* fp)
 
 	if (jpeg->huffman_tables == NULL)
 	{
-		jpeg->huffman_tables = (struct HuffmanTable*)malloc(sizeof(struct HuffmanTable) * MAX_HUFFMAN_TABLES);
+		jpeg->huffman_tables = (struct HuffmanTable*)jpeg_malloc(jpeg, sizeof(struct HuffmanTable) * MAX_HUFFMAN_TABLES);
 		if (jpeg->huffman_tables == NULL)
 		{
 			ERROR_LOG("Failed to allocate memory for huffman tables");
@@ -299,10 +635,12 @@ int load_huffman_table(JPEG* jpeg, FILE* fp)
 		}
 	}
 
-	size_t total_length;
+	long offset = ftell(fp);
+
+	uint16_t total_length;
 	if (fread(&total_length, sizeof(uint8_t), sizeof(uint16_t), fp) != sizeof(uint16_t))
 	{
-		ERROR_LOG("Failed to read length of huffman tables");
+		jpeg_error(jpeg, ftell(fp), "Failed to read length of huffman tables");
 		return 1;
 	}
 
@@ -311,13 +649,20 @@ int load_huffman_table(JPEG* jpeg, FILE* fp)
 
 	while (read_length < total_length)
 	{
+		if (jpeg->num_huffman_tables == MAX_HUFFMAN_TABLES)
+		{
+			jpeg_error(jpeg, offset, "Too many huffman tables");
+			return 1;
+		}
+
 		struct HuffmanTable* current_table = jpeg->huffman_tables + jpeg->num_huffman_tables;
+		memzero(current_table, sizeof(struct HuffmanTable));
 		jpeg->num_huffman_tables++;
 
 		uint8_t meta_info;
 		if (fread(&meta_info, sizeof(uint8_t), sizeof(uint8_t), fp) != sizeof(uint8_t))
 		{
-			ERROR_LOG("Failed to read huffman table #%zu meta info", jpeg->num_huffman_tables);
+			jpeg_error(jpeg, ftell(fp), "Failed to read huffman table #%zu meta info", jpeg->num_huffman_tables);
 			return 1;
 		}
 
@@ -326,14 +671,30 @@ int load_huffman_table(JPEG* jpeg, FILE* fp)
 		current_table->class = ((meta_info >> 4) == 0) ? DCTable : ACTable;
 		current_table->destination = meta_info & 0x0F;
 
+		if ((jpeg->flags & LoadValidate) && ((meta_info >> 4) > 1 || current_table->destination > 3))
+		{
+			jpeg_error(jpeg, offset, "Invalid huffman table class/destination 0x%02X", meta_info);
+			return 1;
+		}
+
 		if (fread(current_table->num_codes, sizeof(uint8_t), 16, fp) != 16)
 		{
-			ERROR_LOG("Failed to read huffman code lengths for table #%zu", jpeg->num_huffman_tables);
+			jpeg_error(jpeg, ftell(fp), "Failed to read huffman code lengths for table #%zu", jpeg->num_huffman_tables);
 			return 1;
 		}
 
 		read_length += 16;
 
+		size_t total_codes = 0;
+		for (size_t i = 0; i < 16; i++)
+			total_codes += current_table->num_codes[i];
+
+		if (total_codes > 256)
+		{
+			jpeg_error(jpeg, offset, "Huffman table #%zu defines %zu codes", jpeg->num_huffman_tables, total_codes);
+			return 1;
+		}
+
 		DEBUG_LOG(
 			"Huffman table #%zu\n"
 			"\tclass = %s\n"
@@ -349,31 +710,40 @@ int load_huffman_table(JPEG* jpeg, FILE* fp)
 			current_table->num_codes[12], current_table->num_codes[13], current_table->num_codes[14], current_table->num_codes[15]
 		);
 
-		for (size_t i = 0; i < 16; i++)
+		uint8_t values[256];
+		if (fread(values, sizeof(uint8_t), total_codes, fp) != total_codes)
 		{
-			if (current_table->num_codes[i] == 0)
-			{
-				current_table->codes[i] = NULL;
-				continue;
-			}
+			jpeg_error(jpeg, ftell(fp), "Failed to read huffman codes for table #%zu", jpeg->num_huffman_tables);
+			return 1;
+		}
 
-			current_table->codes[i] = (uint8_t*)malloc(sizeof(uint8_t) * current_table->num_codes[i]);
-			if (current_table->codes[i] == NULL)
-			{
-				ERROR_LOG("Failed to allocate memory for huffman table #%zu list of codes of length %zu", jpeg->num_huffman_tables, i);
-				return 1;
-			}
+		read_length += total_codes;
 
-			if (fread(current_table->codes[i], sizeof(uint8_t), current_table->num_codes[i], fp) != current_table->num_codes[i])
-			{
-				ERROR_LOG("Failed to read huffman codes of length %zu for table #%zu", i, jpeg->num_huffman_tables);
-				return 1;
-			}
+		// Identical tables share one decoder, so nothing is allocated per image for them
+		current_table->decoder = acquire_huffman_decoder(current_table->num_codes, values);
+		if (current_table->decoder == NULL)
+			return 1;
+
+		if ((jpeg->flags & LoadValidate) && !current_table->decoder->valid)
+		{
+			jpeg_error(jpeg, offset, "Huffman table #%zu has more codes of a length than fit", jpeg->num_huffman_tables);
+			return 1;
+		}
 
-			read_length += current_table->num_codes[i];
+		const uint8_t* codes = current_table->decoder->values;
+		for (size_t i = 0; i < 16; i++)
+		{
+			current_table->codes[i] = (current_table->num_codes[i] == 0) ? NULL : codes;
+			codes += current_table->num_codes[i];
 		}
 	}
 
+	if ((jpeg->flags & LoadValidate) && read_length != total_length)
+	{
+		jpeg_error(jpeg, offset, "DHT length %u doesn't match its tables (%zu bytes)", total_length, read_length);
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -384,13 +754,15 @@ int load_start_of_frame(JPEG* jpeg, FILE* fp, uint8_t type)
 	assert(jpeg);
 	assert(fp);
 
+	long offset = ftell(fp);
+
 	if (jpeg->frame_header != NULL)
 	{
-		ERROR_LOG("Found multiple frames");
+		jpeg_error(jpeg, offset, "Found multiple frames");
 		return 1;
 	}
 
-	jpeg->frame_header = (struct FrameHeader*)malloc(sizeof(struct FrameHeader));
+	jpeg->frame_header = (struct FrameHeader*)jpeg_malloc(jpeg, sizeof(struct FrameHeader));
 	if (jpeg->frame_header == NULL)
 	{
 		ERROR_LOG("Failed to allocate memory for frame header");
@@ -401,7 +773,7 @@ int load_start_of_frame(JPEG* jpeg, FILE* fp, uint8_t type)
 
 	if (fread(jpeg->frame_header, sizeof(uint8_t), FRAME_HEADER_SIZE, fp) != FRAME_HEADER_SIZE)
 	{
-		ERROR_LOG("Failed to read data from frame header");
+		jpeg_error(jpeg, ftell(fp), "Failed to read data from frame header");
 		return 1;
 	}
 
@@ -411,7 +783,7 @@ int load_start_of_frame(JPEG* jpeg, FILE* fp, uint8_t type)
 
 	jpeg->frame_header->encoding = type;
 
-	jpeg->frame_header->components = (struct FrameComponent*)malloc(sizeof(struct FrameComponent) * jpeg->frame_header->num_components);
+	jpeg->frame_header->components = (struct FrameComponent*)jpeg_malloc(jpeg, sizeof(struct FrameComponent) * jpeg->frame_header->num_components);
 	if (jpeg->frame_header->components == NULL)
 	{
 		ERROR_LOG("Failed to allocate memory for frame components");
@@ -423,7 +795,13 @@ int load_start_of_frame(JPEG* jpeg, FILE* fp, uint8_t type)
 		struct FrameComponent* current_component = jpeg->frame_header->components + c;
 		if (fread(current_component, sizeof(uint8_t), sizeof(struct FrameComponent), fp) != sizeof(struct FrameComponent))
 		{
-			ERROR_LOG("Failed to read component #%zu", c);
+			jpeg_error(jpeg, ftell(fp), "Failed to read component #%zu", c);
+			return 1;
+		}
+
+		if (current_component->sampling_factor.v == 0 || current_component->sampling_factor.h == 0)
+		{
+			jpeg_error(jpeg, offset, "Frame component #%zu has a sampling factor of 0", c);
 			return 1;
 		}
 
@@ -431,6 +809,11 @@ int load_start_of_frame(JPEG* jpeg, FILE* fp, uint8_t type)
 		jpeg->frame_header->max_sampling_factor.h = fmaxl(jpeg->frame_header->max_sampling_factor.h, current_component->sampling_factor.h);
 	}
 
+	if ((jpeg->flags & LoadValidate) && validate_frame_header(jpeg, offset) != 0)
+	{
+		return 1;
+	}
+
 	DEBUG_LOG(
 		"Frame header\n"
 		"\tlength = %d\n"
@@ -480,72 +863,118 @@ int load_start_of_scan(JPEG* jpeg, FILE* fp)
 	assert(jpeg);
 	assert(fp);
 
-	if (jpeg->scan_header != NULL)
+	long offset = ftell(fp);
+
+	if (jpeg->frame_header == NULL)
 	{
-		ERROR_LOG("Found multiple scans");
+		jpeg_error(jpeg, offset, "Found scan before frame header");
 		return 1;
 	}
 
-	jpeg->scan_header = (struct ScanHeader*)malloc(sizeof(struct ScanHeader));
-	if (jpeg->scan_header == NULL)
+	if (jpeg->num_scan_headers == jpeg->scan_header_capacity)
 	{
-		ERROR_LOG("Failed to allocate memory for scan header");
-		return 1;
+		size_t new_capacity = (jpeg->scan_header_capacity == 0) ? 4 : jpeg->scan_header_capacity * 2;
+
+		struct ScanHeader* scan_headers = (struct ScanHeader*)jpeg_realloc(
+			jpeg, jpeg->scan_headers,
+			sizeof(struct ScanHeader) * jpeg->scan_header_capacity,
+			sizeof(struct ScanHeader) * new_capacity
+		);
+		if (scan_headers == NULL)
+		{
+			ERROR_LOG("Failed to allocate memory for scan header");
+			return 1;
+		}
+
+		jpeg->scan_headers = scan_headers;
+		jpeg->scan_header_capacity = new_capacity;
+	}
+
+	struct ScanHeader* scan_header = jpeg->scan_headers + jpeg->num_scan_headers;
+	memzero(scan_header, sizeof(struct ScanHeader));
+
+	jpeg->num_scan_headers++;
+
+	if (fread(scan_header, sizeof(uint8_t), SCAN_HEADER_PRE_SIZE, fp) != SCAN_HEADER_PRE_SIZE)
+	{
+		jpeg_error(jpeg, ftell(fp), "Failed to read length of scan header or scan header components");
+		return 1;
 	}
 
-	if (fread(jpeg->scan_header, sizeof(uint8_t), SCAN_HEADER_PRE_SIZE, fp) != SCAN_HEADER_PRE_SIZE)
+	scan_header->length = bswap_16(scan_header->length);
+
+	if (scan_header->num_components == 0 || scan_header->num_components > MAX_SCAN_COMPONENTS)
 	{
-		ERROR_LOG("Failed to read length of scan header or scan header components");
+		jpeg_error(jpeg, offset, "Invalid number of scan components (%u)", scan_header->num_components);
 		return 1;
 	}
 
-	jpeg->scan_header->length = bswap_16(jpeg->scan_header->length);
+	if ((jpeg->flags & LoadValidate) && scan_header->length != SCAN_HEADER_PRE_SIZE + SCAN_HEADER_POST_SIZE + sizeof(struct ScanComponent) * scan_header->num_components)
+	{
+		jpeg_error(jpeg, offset, "Scan header length %u doesn't match its %u components", scan_header->length, scan_header->num_components);
+		return 1;
+	}
 
-	jpeg->scan_header->components = (struct ScanComponent*)malloc(sizeof(struct ScanComponent) * jpeg->scan_header->num_components);
-	if (jpeg->scan_header == NULL)
+	scan_header->components = (struct ScanComponent*)jpeg_malloc(jpeg, sizeof(struct ScanComponent) * scan_header->num_components);
+	if (scan_header->components == NULL)
 	{
 		ERROR_LOG("Failed to allocate memory for scan header components");
 		return 1;
 	}
 
-	for (size_t i = 0; i < jpeg->scan_header->num_components; i++)
+	for (size_t i = 0; i < scan_header->num_components; i++)
 	{
-		struct ScanComponent* current_component = jpeg->scan_header->components + i;
+		struct ScanComponent* current_component = scan_header->components + i;
 
 		if (fread(current_component, sizeof(uint8_t), sizeof(struct ScanComponent), fp) != sizeof(struct ScanComponent))
 		{
-			ERROR_LOG("Failed to load component #%zu of scan header", i);
+			jpeg_error(jpeg, ftell(fp), "Failed to load component #%zu of scan header", i);
 			return 1;
 		}
 	}
 
-	if (fread(&jpeg->scan_header->spectral_select_start, sizeof(uint8_t), SCAN_HEADER_POST_SIZE, fp) != SCAN_HEADER_POST_SIZE)
+	if (fread(&scan_header->spectral_select_start, sizeof(uint8_t), SCAN_HEADER_POST_SIZE, fp) != SCAN_HEADER_POST_SIZE)
 	{
-		ERROR_LOG("Failed to read spectral selection info");
+		jpeg_error(jpeg, ftell(fp), "Failed to read spectral selection info");
 		return 1;
 	}
 
 	DEBUG_LOG(
-		"Scan header\n"
+		"Scan header #%zu\n"
 		"\tcomponents = %d\n"
 		"\tspectral select s/e = %d/%d\n"
 		"\tapprox bit pos h/l = %d/%d",
 
-		jpeg->scan_header->num_components,
-		jpeg->scan_header->spectral_select_start, jpeg->scan_header->spectral_select_end,
-		jpeg->scan_header->approx_bit_pos.high, jpeg->scan_header->approx_bit_pos.low
+		jpeg->num_scan_headers,
+		scan_header->num_components,
+		scan_header->spectral_select_start, scan_header->spectral_select_end,
+		scan_header->approx_bit_pos.high, scan_header->approx_bit_pos.low
 	);
 
-	jpeg->scans = (struct Scan*)malloc(sizeof(struct Scan) * jpeg->scan_header->num_components);
-	if (jpeg->scans == NULL)
+	if (jpeg->num_scans + scan_header->num_components > jpeg->scan_capacity)
 	{
-		ERROR_LOG("Failed to allocate memory for scan data");
-		return 1;
+		size_t new_capacity = (jpeg->scan_capacity == 0) ? 4 : jpeg->scan_capacity * 2;
+		while (new_capacity < jpeg->num_scans + scan_header->num_components)
+			new_capacity *= 2;
+
+		struct Scan* scans = (struct Scan*)jpeg_realloc(
+			jpeg, jpeg->scans,
+			sizeof(struct Scan) * jpeg->scan_capacity,
+			sizeof(struct Scan) * new_capacity
+		);
+		if (scans == NULL)
+		{
+			ERROR_LOG("Failed to allocate memory for scan data");
+			return 1;
+		}
+
+		jpeg->scans = scans;
+		jpeg->scan_capacity = new_capacity;
 	}
 
-	for (size_t i = 0; i < jpeg->scan_header->num_components; i++)
+	for (size_t i = 0; i < scan_header->num_components; i++)
 	{
-		struct ScanComponent* scan_component = jpeg->scan_header->components + i;
+		struct ScanComponent* scan_component = scan_header->components + i;
 
 		DEBUG_LOG(
 			"Scan header component #%zu\n"
@@ -563,7 +992,26 @@ int load_start_of_scan(JPEG* jpeg, FILE* fp)
 		}
 	}
 
-	return 0;
+	if ((jpeg->flags & LoadValidate) && validate_scan_tables(jpeg, scan_header, offset) != 0)
+	{
+		return 1;
+	}
+
+	// AC-only scans of progressive images don't contribute to the DC coefficients
+	int skip_scan = (jpeg->flags & LoadDCOnly) && !(jpeg->flags & LoadValidate) && scan_header->spectral_select_start > 0;
+
+	if ((jpeg->flags & (LoadDecodeScans | LoadValidate)) && !skip_scan)
+	{
+		long data_offset = ftell(fp);
+		if (decode_scan(jpeg, fp, scan_header) != 0)
+		{
+			return 1;
+		}
+
+		return index_segment(jpeg, ENTROPY_CODED_SEGMENT, data_offset, ftell(fp) - data_offset);
+	}
+
+	return skip_entropy_coded_data(jpeg, fp);
 }
 
 int load_scan_data(JPEG* jpeg, FILE* fp, struct ScanComponent* scan_component)
@@ -587,7 +1035,7 @@ int load_scan_data(JPEG* jpeg, FILE* fp, struct ScanComponent* scan_component)
 
 	if (frame_component == NULL)
 	{
-		ERROR_LOG("Couldn't find matching frame component for scan component (%d)", scan_component->identifier);
+		jpeg_error(jpeg, ftell(fp), "Couldn't find matching frame component for scan component (%d)", scan_component->identifier);
 		return 1;
 	}
 
@@ -604,28 +1052,194 @@ int load_scan_data(JPEG* jpeg, FILE* fp, struct ScanComponent* scan_component)
 
 	scan->length = (size_t)scan->width * scan->height;
 
-	scan->data = (uint8_t*)malloc(sizeof(uint8_t) * scan->length);
-	if (scan->data == NULL)
+	// Samples are only produced by decoding the entropy-coded data
+	scan->data = NULL;
+
+	jpeg->num_scans++;
+
+	return 0;
+}
+
+int skip_entropy_coded_data(JPEG* jpeg, FILE* fp)
+{
+	assert(jpeg);
+	assert(fp);
+
+	long offset = ftell(fp);
+	long position = offset;
+
+	// The entropy-coded data ends at the first marker that isn't a stuffed byte (0xFF 0x00) or RSTn.
+	// One extra byte is kept in front of each chunk so a 0xFF at the end of a chunk can be checked.
+	uint8_t buffer[SCAN_CHUNK_SIZE + 1];
+	size_t carry = 0;
+
+	for (;;)
+	{
+		size_t read = fread(buffer + carry, sizeof(uint8_t), SCAN_CHUNK_SIZE, fp);
+		if (read == 0)
+		{
+			ERROR_LOG("Entropy-coded data terminated unexpectedly");
+			return 1;
+		}
+
+		size_t available = carry + read;
+		uint8_t* current = buffer;
+		uint8_t* end = buffer + available;
+
+		while ((current = (uint8_t*)memchr(current, 0xFF, end - current)) != NULL)
+		{
+			if (current + 1 == end)
+				break;
+
+			uint8_t code = current[1];
+			if (code != 0x00 && code != 0xFF && (code < 0xD0 || code > 0xD7))
+			{
+				long marker_position = position + (long)(current - buffer);
+
+				if (index_segment(jpeg, ENTROPY_CODED_SEGMENT, offset, marker_position - offset) != 0)
+				{
+					return 1;
+				}
+
+				DEBUG_LOG("Skipped %ld bytes of entropy-coded data", marker_position - offset);
+
+				if (fseek(fp, marker_position, SEEK_SET) != 0)
+				{
+					ERROR_LOG("Failed to seek past entropy-coded data");
+					return 1;
+				}
+
+				return 0;
+			}
+
+			current++;
+		}
+
+		// Keep a trailing 0xFF around since its marker code is in the next chunk
+		carry = (buffer[available - 1] == 0xFF) ? 1 : 0;
+		position += (long)(available - carry);
+		if (carry)
+			buffer[0] = 0xFF;
+	}
+}
+
+int load_arithmetic_conditioning(JPEG* jpeg, FILE* fp)
+{
+	DEBUG_LOG("DAC encountered");
+
+	assert(jpeg);
+	assert(fp);
+
+	long offset = ftell(fp);
+
+	uint16_t length;
+	if (fread(&length, sizeof(uint8_t), sizeof(uint16_t), fp) != sizeof(uint16_t))
 	{
-		ERROR_LOG("Failed to allocate memory for scan data");
+		ERROR_LOG("Failed to read length of arithmetic conditioning");
 		return 1;
 	}
 
-	jpeg->num_scans++;
+	length = bswap_16(length);
+	if (length < 2 || length % 2 != 0)
+	{
+		jpeg_error(jpeg, offset, "Invalid DAC segment length %u", length);
+		return 1;
+	}
 
-	size_t tmp = fread(scan->data, sizeof(uint8_t), scan->length, fp);
-	if (tmp != scan->length)
+	size_t num_conditionings = (length - 2) / 2;
+	if (num_conditionings == 0)
+		return 0;
+
+	struct ArithmeticConditioning* conditionings = (struct ArithmeticConditioning*)jpeg_realloc(
+		jpeg, jpeg->arithmetic_conditionings,
+		sizeof(struct ArithmeticConditioning) * jpeg->num_arithmetic_conditionings,
+		sizeof(struct ArithmeticConditioning) * (jpeg->num_arithmetic_conditionings + num_conditionings)
+	);
+
+	if (conditionings == NULL)
 	{
-		ERROR_LOG("Failed to load scan data from file");
+		ERROR_LOG("Failed to allocate memory for arithmetic conditioning");
 		return 1;
 	}
 
+	jpeg->arithmetic_conditionings = conditionings;
+
+	for (size_t i = 0; i < num_conditionings; i++)
+	{
+		uint8_t data[2];
+		if (fread(data, sizeof(uint8_t), 2, fp) != 2)
+		{
+			ERROR_LOG("Failed to read arithmetic conditioning #%zu", jpeg->num_arithmetic_conditionings);
+			return 1;
+		}
+
+		struct ArithmeticConditioning* current = jpeg->arithmetic_conditionings + jpeg->num_arithmetic_conditionings;
+		jpeg->num_arithmetic_conditionings++;
+
+		current->class = ((data[0] >> 4) == 0) ? DCTable : ACTable;
+		current->destination = data[0] & 0x0F;
+		current->value = data[1];
+
+		DEBUG_LOG(
+			"Arithmetic conditioning #%zu\n"
+			"\tclass = %s\n"
+			"\tdestination = %d\n"
+			"\tvalue = 0x%02X",
+
+			jpeg->num_arithmetic_conditionings,
+			(current->class == DCTable) ? "DC" : "AC",
+			current->destination,
+			current->value
+		);
+
+		// Decoding relies on L <= U and 1 <= Kx <= 63 (T.81, B.2.4.3)
+		int valid = (current->class == DCTable) ?
+			(current->value & 0x0F) <= (current->value >> 4) :
+			(current->value >= 1 && current->value <= 63);
+
+		if (!valid || (data[0] >> 4) > 1 || current->destination > 3)
+		{
+			jpeg_error(jpeg, offset, "Invalid arithmetic conditioning 0x%02X 0x%02X", data[0], data[1]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int load_restart_interval(JPEG* jpeg, FILE* fp)
+{
+	DEBUG_LOG("DRI encountered");
+
+	assert(jpeg);
+	assert(fp);
+
+	long offset = ftell(fp);
+
+	uint16_t data[2];
+	if (fread(data, sizeof(uint16_t), 2, fp) != 2)
+	{
+		ERROR_LOG("Failed to read restart interval");
+		return 1;
+	}
+
+	if (bswap_16(data[0]) != sizeof(data))
+	{
+		jpeg_error(jpeg, offset, "Invalid DRI segment length %u", bswap_16(data[0]));
+		return 1;
+	}
+
+	jpeg->restart_interval = bswap_16(data[1]);
+	DEBUG_LOG("restart interval = %u", jpeg->restart_interval);
+
 	return 0;
 }
 
 int load_rst_segment(JPEG* jpeg, FILE* fp, uint8_t n)
 {
 	DEBUG_LOG("RST%d marker encountered", n);
+
+	jpeg_error(jpeg, ftell(fp) - 2, "RST%d marker outside of entropy-coded data", n);
 	return 1;
 }
 
@@ -638,8 +1252,8 @@ int load_app_segment(JPEG* jpeg, FILE* fp, uint8_t n)
 	case 0:	return load_app0_segment(jpeg, fp);
 
 	default: 
-		ERROR_LOG("Unknown APP segment ID %d", n);
-		return 1;
+		// Other application segments (EXIF, ICC, XMP, ...) are only indexed
+		break;
 	}
 
 	return 0;
@@ -647,51 +1261,48 @@ int load_app_segment(JPEG* jpeg, FILE* fp, uint8_t n)
 
 int load_app0_segment(JPEG* jpeg, FILE* fp)
 {
+	assert(jpeg);
+	assert(fp);
+
+	struct JFIFAPP0Segment header;
+	memzero(&header, sizeof(struct JFIFAPP0Segment));
+
+	// Extract header without thumbnail data
+	if (fread(&header, sizeof(uint8_t), JFIF_APP0_SIZE, fp) != JFIF_APP0_SIZE)
+	{
+		// Too short to be JFIF, so it is some other APP0 segment
+		DEBUG_LOG("Skipping short APP0 segment");
+		return 0;
+	}
+
+	// JFXX extension segments and other APP0 users are only indexed
+	if (memcmp(header.identifier, "JFIF", 5) != 0)
+	{
+		DEBUG_LOG("Skipping non-JFIF APP0 segment");
+		return 0;
+	}
+
 	if (jpeg->app0 != NULL)
 	{
 		ERROR_LOG("Found more than one APP0 marker");
 		return 1;
 	}
 
-	assert(jpeg);
-	assert(fp);
-
-	jpeg->app0 = (struct JFIFAPP0Segment*)malloc(sizeof(struct JFIFAPP0Segment));
-	memzero(jpeg->app0, sizeof(struct JFIFAPP0Segment));
-
+	jpeg->app0 = (struct JFIFAPP0Segment*)jpeg_malloc(jpeg, sizeof(struct JFIFAPP0Segment));
 	if (jpeg->app0 == NULL)
 	{
 		ERROR_LOG("Failed to allocate memory for APP0 header");
 		return 1;
 	}
 
-	// Extract header without thumbnail data
-	if (fread(jpeg->app0, sizeof(uint8_t), JFIF_APP0_SIZE, fp) != JFIF_APP0_SIZE)
-	{
-		ERROR_LOG("Incomplete APP0 header");
-		return 1;
-	}
+	memcpy(jpeg->app0, &header, sizeof(struct JFIFAPP0Segment));
 
 	jpeg->app0->length = bswap_16(jpeg->app0->length);
 	jpeg->app0->density_x = bswap_16(jpeg->app0->density_x);
 	jpeg->app0->density_y = bswap_16(jpeg->app0->density_y);
 
-	size_t thumbnail_data_size = jpeg->app0->thumbnail_x * jpeg->app0->thumbnail_y;
-	if (thumbnail_data_size > 0)
-	{
-		jpeg->app0->thumbnail_data = (uint8_t*)malloc(thumbnail_data_size * sizeof(uint8_t));
-		if (jpeg->app0->thumbnail_data == NULL)
-		{
-			ERROR_LOG("Failed to allocate memory for thumbnail data");
-			return 1;
-		}
-
-		if (fread(jpeg->app0->thumbnail_data, sizeof(uint8_t), thumbnail_data_size, fp) != thumbnail_data_size)
-		{
-			ERROR_LOG("Incomplete thumbnail data");
-			return 1;
-		}
-	}
+	// The thumbnail is loaded on demand by load_jfif_thumbnail()
+	jpeg->app0->thumbnail_data = NULL;
 
 	DEBUG_LOG(
 		"JFIFAPP0Segment\n"
@@ -709,4 +1320,246 @@ int load_app0_segment(JPEG* jpeg, FILE* fp)
 		jpeg->app0->thumbnail_x, jpeg->app0->thumbnail_y
 	);
 	return 0;
+}
+
+const struct Segment* find_app_segment(JPEG* jpeg, uint8_t n, const char* identifier)
+{
+	assert(jpeg);
+	assert(identifier);
+
+	// The terminating zero is part of every APPn identifier
+	size_t identifier_length = strlen(identifier) + 1;
+
+	char prefix[64];
+	if (identifier_length > sizeof(prefix))
+	{
+		ERROR_LOG("APP segment identifier is too long");
+		return NULL;
+	}
+
+	for (size_t i = 0; i < jpeg->num_segments; i++)
+	{
+		const struct Segment* segment = jpeg->segments + i;
+		if (segment->marker != 0xE0 + n || segment->length < identifier_length)
+			continue;
+
+		if (fseek(jpeg->fp, segment->offset, SEEK_SET) != 0)
+		{
+			ERROR_LOG("Failed to seek to APP%d segment", n);
+			return NULL;
+		}
+
+		if (fread(prefix, sizeof(uint8_t), identifier_length, jpeg->fp) != identifier_length)
+		{
+			ERROR_LOG("Failed to read identifier of APP%d segment", n);
+			return NULL;
+		}
+
+		if (memcmp(prefix, identifier, identifier_length) == 0)
+			return segment;
+	}
+
+	return NULL;
+}
+
+uint8_t* read_segment(JPEG* jpeg, const struct Segment* segment)
+{
+	assert(jpeg);
+	assert(segment);
+
+	uint8_t* data = (uint8_t*)malloc(segment->length > 0 ? segment->length : 1);
+	if (data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for segment 0xFF 0x%02X", segment->marker);
+		return NULL;
+	}
+
+	if (fseek(jpeg->fp, segment->offset, SEEK_SET) != 0 ||
+		fread(data, sizeof(uint8_t), segment->length, jpeg->fp) != segment->length)
+	{
+		ERROR_LOG("Failed to read segment 0xFF 0x%02X", segment->marker);
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+const struct QuantizationTable* find_quantization_table(JPEG* jpeg, uint8_t destination)
+{
+	assert(jpeg);
+
+	// Tables can be redefined between scans, so the latest definition wins
+	for (size_t i = jpeg->num_quantization_tables; i > 0; i--)
+	{
+		const struct QuantizationTable* table = jpeg->quantization_tables + (i - 1);
+		if (table->destination == destination && table->data != NULL)
+			return table;
+	}
+
+	return NULL;
+}
+
+void get_quantization_values(const struct QuantizationTable* table, uint16_t values[64])
+{
+	assert(table);
+	assert(values);
+
+	for (int k = 0; k < 64; k++)
+	{
+		values[natural_order[k]] = (table->precision == sizeof(uint16_t)) ?
+			(uint16_t)((table->data[2 * k] << 8) | table->data[2 * k + 1]) :
+			table->data[k];
+	}
+}
+
+uint8_t* load_jfif_thumbnail(JPEG* jpeg)
+{
+	assert(jpeg);
+
+	if (jpeg->app0 == NULL)
+		return NULL;
+
+	if (jpeg->app0->thumbnail_data != NULL)
+		return jpeg->app0->thumbnail_data;
+
+	// Thumbnail pixels are stored as packed RGB triplets
+	size_t thumbnail_data_size = (size_t)jpeg->app0->thumbnail_x * jpeg->app0->thumbnail_y * 3;
+	if (thumbnail_data_size == 0)
+		return NULL;
+
+	const struct Segment* segment = find_app_segment(jpeg, 0, "JFIF");
+	if (segment == NULL || segment->length < (JFIF_APP0_SIZE - sizeof(uint16_t)) + thumbnail_data_size)
+	{
+		ERROR_LOG("Incomplete thumbnail data");
+		return NULL;
+	}
+
+	jpeg->app0->thumbnail_data = (uint8_t*)jpeg_malloc(jpeg, thumbnail_data_size * sizeof(uint8_t));
+	if (jpeg->app0->thumbnail_data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for thumbnail data");
+		return NULL;
+	}
+
+	long offset = segment->offset + (long)(JFIF_APP0_SIZE - sizeof(uint16_t));
+	if (fseek(jpeg->fp, offset, SEEK_SET) != 0 ||
+		fread(jpeg->app0->thumbnail_data, sizeof(uint8_t), thumbnail_data_size, jpeg->fp) != thumbnail_data_size)
+	{
+		ERROR_LOG("Incomplete thumbnail data");
+
+		jpeg_free(jpeg, jpeg->app0->thumbnail_data);
+		jpeg->app0->thumbnail_data = NULL;
+		return NULL;
+	}
+
+	return jpeg->app0->thumbnail_data;
+}
+
+uint8_t* load_exif(JPEG* jpeg, size_t* size)
+{
+	assert(jpeg);
+	assert(size);
+
+	// The EXIF identifier is followed by a padding byte
+	static const size_t exif_header_size = 6;
+
+	const struct Segment* segment = find_app_segment(jpeg, 1, "Exif");
+	if (segment == NULL || segment->length < exif_header_size)
+		return NULL;
+
+	struct Segment payload = *segment;
+	payload.offset += exif_header_size;
+	payload.length -= exif_header_size;
+
+	uint8_t* data = read_segment(jpeg, &payload);
+	if (data != NULL)
+		*size = payload.length;
+
+	return data;
+}
+
+uint8_t* load_icc_profile(JPEG* jpeg, size_t* size)
+{
+	assert(jpeg);
+	assert(size);
+
+	// "ICC_PROFILE\0" followed by the chunk's sequence number and the total number of chunks
+	static const char icc_identifier[12] = "ICC_PROFILE";
+	static const size_t icc_header_size = sizeof(icc_identifier) + 2;
+
+	uint8_t header[sizeof(icc_identifier) + 2];
+	const struct Segment* chunks[256] = { NULL };
+	size_t num_chunks = 0;
+
+	for (size_t i = 0; i < jpeg->num_segments; i++)
+	{
+		const struct Segment* segment = jpeg->segments + i;
+		if (segment->marker != 0xE2 || segment->length < icc_header_size)
+			continue;
+
+		if (fseek(jpeg->fp, segment->offset, SEEK_SET) != 0 ||
+			fread(header, sizeof(uint8_t), icc_header_size, jpeg->fp) != icc_header_size)
+		{
+			ERROR_LOG("Failed to read APP2 segment header");
+			return NULL;
+		}
+
+		if (memcmp(header, icc_identifier, sizeof(icc_identifier)) != 0)
+			continue;
+
+		// Every chunk has to agree with the first one on the number of chunks
+		uint8_t sequence_number = header[sizeof(icc_identifier)];
+		uint8_t chunk_count = header[sizeof(icc_identifier) + 1];
+		if (num_chunks == 0)
+			num_chunks = chunk_count;
+
+		if (chunk_count != num_chunks || sequence_number == 0 || sequence_number > num_chunks || chunks[sequence_number] != NULL)
+		{
+			ERROR_LOG("Invalid ICC profile chunk #%u of %u", sequence_number, chunk_count);
+			return NULL;
+		}
+
+		chunks[sequence_number] = segment;
+	}
+
+	if (num_chunks == 0)
+		return NULL;
+
+	size_t total_size = 0;
+	for (size_t i = 1; i <= num_chunks; i++)
+	{
+		if (chunks[i] == NULL)
+		{
+			ERROR_LOG("ICC profile chunk #%zu is missing", i);
+			return NULL;
+		}
+
+		total_size += chunks[i]->length - icc_header_size;
+	}
+
+	uint8_t* data = (uint8_t*)malloc(total_size > 0 ? total_size : 1);
+	if (data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for ICC profile");
+		return NULL;
+	}
+
+	uint8_t* current = data;
+	for (size_t i = 1; i <= num_chunks; i++)
+	{
+		size_t chunk_size = chunks[i]->length - icc_header_size;
+		if (fseek(jpeg->fp, chunks[i]->offset + (long)icc_header_size, SEEK_SET) != 0 ||
+			fread(current, sizeof(uint8_t), chunk_size, jpeg->fp) != chunk_size)
+		{
+			ERROR_LOG("Failed to read ICC profile chunk #%zu", i);
+			free(data);
+			return NULL;
+		}
+
+		current += chunk_size;
+	}
+
+	*size = (size_t)(current - data);
+	return data;
 }
\ No newline at end of file
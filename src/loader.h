@@ -8,6 +8,9 @@
 #define ENCODING_DCT_MASK 4
 #define ENCODING_CODING_MASK 8
 
+#define MAX_SCAN_COMPONENTS 4
+#define MAX_ERROR_MESSAGE_SIZE 128
+
 enum EncodingProcess
 {
 	Baseline = 0,
@@ -34,6 +37,15 @@ enum TableClass
 	ACTable
 };
 
+enum LoadFlags
+{
+	LoadIndexOnly = 0,
+	LoadDecodeScans = (1 << 0),		// Entropy-decode all scans into coefficients
+	LoadValidate = (1 << 1),		// Check segment consistency and decode all scans, keeping only what is needed
+	LoadDCOnly = (1 << 2),			// Only decode DC coefficients, AC-only progressive scans are skipped
+	LoadTablesOnly = (1 << 3),		// Stop at the first scan header, so only tables defined before it are loaded
+};
+
 PACK(struct QuantizationTable
 {
 	uint8_t precision;
@@ -46,9 +58,23 @@ PACK(struct HuffmanTable
 	enum TableClass class;
 	uint8_t destination;
 	uint8_t num_codes[16];
-	uint8_t* codes[16];
+	const uint8_t* codes[16];	// Point into the values of the shared decoder
+
+	const struct HuffmanDecoder* decoder;
+});
+
+// Conditioning of arithmetic-coded statistics from a DAC segment. For DC tables the value holds
+// the bounds L (lower nibble) and U (upper nibble), for AC tables Kx.
+PACK(struct ArithmeticConditioning
+{
+	enum TableClass class;
+	uint8_t destination;
+	uint8_t value;
 });
 
+#define DEFAULT_ARITHMETIC_DC_CONDITIONING 0x10
+#define DEFAULT_ARITHMETIC_AC_CONDITIONING 5
+
 #define QUANTIZATION_TABLE_SIZE sizeof(struct QuantizationTable) - sizeof(uint8_t*)
 
 PACK(struct FrameComponent
@@ -87,8 +113,8 @@ PACK(struct ScanComponent
 	uint8_t identifier;
 	struct
 	{
-		uint8_t dc : 4;
 		uint8_t ac : 4;
+		uint8_t dc : 4;
 	} table_destination;
 });
 
@@ -103,8 +129,8 @@ PACK(struct ScanHeader
 
 	struct
 	{
-		uint8_t high : 4;
 		uint8_t low : 4;
+		uint8_t high : 4;
 	} approx_bit_pos;
 });
 
@@ -119,6 +145,18 @@ struct Scan
 	uint8_t* data;
 };
 
+// Quantized DCT coefficients of one frame component, 64 per block in natural order.
+// Blocks cover the component padded to whole MCUs.
+struct ComponentCoefficients
+{
+	uint16_t width;
+	uint16_t height;
+
+	uint16_t blocks_x;
+	uint16_t blocks_y;
+	int16_t* data;
+};
+
 #define SCAN_HEADER_PRE_SIZE sizeof(uint16_t) + sizeof(uint8_t)
 #define SCAN_HEADER_POST_SIZE sizeof(uint8_t) * 3
 
@@ -144,8 +182,30 @@ PACK(struct JFIFAPP0Segment
 
 #define JFIF_APP0_SIZE sizeof(struct JFIFAPP0Segment) - sizeof(uint8_t*)
 
+// Pseudo-marker used in the segment index for the entropy-coded data following an SOS
+#define ENTROPY_CODED_SEGMENT 0x00
+
+struct Segment
+{
+	uint8_t marker;
+	long offset;		// Offset of the payload (right after the length field)
+	size_t length;		// Length of the payload (without the length field)
+};
+
 typedef struct JPEG
 {
+	struct DecoderContext* context;
+	FILE* fp;
+	long start_offset;	// Offset of the SOI marker in the stream
+	unsigned flags;
+
+	long error_offset;
+	char error_message[MAX_ERROR_MESSAGE_SIZE];
+
+	size_t num_segments;
+	size_t segment_capacity;
+	struct Segment* segments;
+
 	struct JFIFAPP0Segment* app0;
 
 	size_t num_quantization_tables;
@@ -154,14 +214,59 @@ typedef struct JPEG
 	size_t num_huffman_tables;
 	struct HuffmanTable* huffman_tables;
 
+	size_t num_arithmetic_conditionings;
+	struct ArithmeticConditioning* arithmetic_conditionings;
+
+	uint16_t restart_interval;
+
 	struct FrameHeader* frame_header;
-	struct ScanHeader* scan_header;
+	struct ComponentCoefficients* coefficients;
+
+	size_t num_scan_headers;
+	size_t scan_header_capacity;
+	struct ScanHeader* scan_headers;
 
 	size_t num_scans;
+	size_t scan_capacity;
 	struct Scan* scans;
 } JPEG;
 
 JPEG* load_jpeg(const char* filename);
+JPEG* load_jpeg_with_flags(const char* filename, unsigned flags);
 void free_jpeg(JPEG* jpeg);
 
+// Parses an image from an already opened stream into a zeroed JPEG (apart from its flags), which takes ownership of the stream
+int load_jpeg_stream(JPEG* jpeg, FILE* fp);
+
+// Parses an image again from its still open stream with the given LoadFlags added, e.g. to decode
+// the scans of an image that was only indexed. On failure the image only holds the error.
+int reload_jpeg(JPEG* jpeg, unsigned flags);
+
+// Images parsed from memory read from the buffer directly, so it has to outlive them
+JPEG* load_jpeg_memory(const uint8_t* data, size_t size);
+JPEG* load_jpeg_memory_with_flags(const uint8_t* data, size_t size, unsigned flags);
+FILE* open_memory_file(const uint8_t* data, size_t size);
+
+// Segment payloads are only read from the file when requested.
+// Returns an entry of the segment index, which the image owns.
+const struct Segment* find_app_segment(JPEG* jpeg, uint8_t n, const char* identifier);
+// Returns the payload in a buffer the caller must free.
+uint8_t* read_segment(JPEG* jpeg, const struct Segment* segment);
+
+// Latest definition of a quantization table destination, NULL if there is none
+const struct QuantizationTable* find_quantization_table(JPEG* jpeg, uint8_t destination);
+
+// Converts the zig-zag ordered table entries to natural order
+void get_quantization_values(const struct QuantizationTable* table, uint16_t values[64]);
+
+// Packed RGB pixels of the JFIF thumbnail. The image owns them and releases them with free_jpeg().
+uint8_t* load_jfif_thumbnail(JPEG* jpeg);
+
+// These return buffers the caller must free.
+uint8_t* load_exif(JPEG* jpeg, size_t* size);
+uint8_t* load_icc_profile(JPEG* jpeg, size_t* size);
+
+// Logs an error and keeps the first one (with the offset in the file it refers to) on the image
+void jpeg_error(JPEG* jpeg, long offset, const char* format, ...);
+
 #endif // _LOADER_H
\ No newline at end of file
@@ -1,19 +1,286 @@
 ﻿#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include "loader.h"
+#include "batch.h"
+#include "validate.h"
+#include "carve.h"
+#include "export.h"
+#include "preview.h"
+#include "output.h"
+#include "hash.h"
+#include "analysis.h"
 
 static void print_usage(void)
 {
 	printf("Usage: ./jpeg-dissect <JPEG file>\n");
+	printf("       ./jpeg-dissect <JPEG file> <JPEG file>...\n");
+	printf("       ./jpeg-dissect --validate <JPEG file>...\n");
+	printf("       ./jpeg-dissect --carve <file>\n");
+	printf("       ./jpeg-dissect --export <JPEG file> <output file>\n");
+	printf("       ./jpeg-dissect --preview <size> <JPEG file>\n");
+	printf("       ./jpeg-dissect --hash <JPEG file>...\n");
+	printf("       ./jpeg-dissect --analyze <JPEG file>...\n");
+	printf("       ./jpeg-dissect --output <ppm|rgb|yuv|y4m> <JPEG file> <output file|->\n");
+}
+
+static void print_carved_image(const struct CarvedImage* image, JPEG* jpeg, void* user_data)
+{
+	(void)user_data;
+
+	printf(
+		"%zu %zu %ux%u\n",
+		image->offset, image->length,
+		jpeg->frame_header->num_samples, jpeg->frame_header->num_lines
+	);
+}
+
+static int validate_files(int num_files, char** filenames)
+{
+	int num_failed = 0;
+
+	for (int i = 0; i < num_files; i++)
+	{
+		struct ValidationError error;
+		if (validate_jpeg(filenames[i], &error) != 0)
+		{
+			printf("%s: invalid at offset %ld: %s\n", filenames[i], error.offset, error.message);
+			num_failed++;
+			continue;
+		}
+
+		printf("%s: valid\n", filenames[i]);
+	}
+
+	return (num_failed > 0) ? 1 : 0;
+}
+
+static void print_batch_result(const char* filename, JPEG* jpeg, const char* error, void* user_data)
+{
+	int* num_failed = (int*)user_data;
+
+	if (jpeg == NULL || jpeg->frame_header == NULL)
+	{
+		printf("%s: failed to load: %s\n", filename, (error != NULL) ? error : "no frame header");
+		(*num_failed)++;
+		return;
+	}
+
+	printf(
+		"%s: %ux%u, %u component(s)\n",
+		filename,
+		jpeg->frame_header->num_samples, jpeg->frame_header->num_lines,
+		jpeg->frame_header->num_components
+	);
+}
+
+static void print_batch_hash(const char* filename, JPEG* jpeg, const char* error, void* user_data)
+{
+	int* num_failed = (int*)user_data;
+
+	if (jpeg == NULL)
+	{
+		printf("%s: failed to load: %s\n", filename, error);
+		(*num_failed)++;
+		return;
+	}
+
+	struct ImageHash hash;
+	if (jpeg->frame_header == NULL || hash_jpeg(jpeg, &hash) != 0)
+	{
+		printf("%s: failed to hash\n", filename);
+		(*num_failed)++;
+		return;
+	}
+
+	printf(
+		"%s: %ux%u, phash %016" PRIx64 ", dhash %016" PRIx64 "\n",
+		filename,
+		jpeg->frame_header->num_samples, jpeg->frame_header->num_lines,
+		hash.phash, hash.dhash
+	);
+}
+
+static void print_quality(const char* name, const struct QualityEstimate* estimate)
+{
+	if (estimate->quality == 0)
+		return;
+
+	if (estimate->exact)
+		printf("%s quality %d, ", name, estimate->quality);
+	else
+		printf("%s quality ~%d (error %.2f), ", name, estimate->quality, estimate->error);
+}
+
+static int analyze_files(int num_files, char** filenames)
+{
+	static const char* huffman_styles[] =
+	{
+		"standard Huffman tables", "optimized Huffman tables", "mixed Huffman tables",
+		"implicit Huffman tables", "arithmetic coding", ""
+	};
+
+	int num_failed = 0;
+
+	for (int i = 0; i < num_files; i++)
+	{
+		struct Analysis analysis;
+		if (analyze_jpeg_file(filenames[i], &analysis) != 0)
+		{
+			printf("%s: failed to analyze\n", filenames[i]);
+			num_failed++;
+			continue;
+		}
+
+		printf("%s: ", filenames[i]);
+		print_quality("luminance", &analysis.luminance);
+		print_quality("chrominance", &analysis.chrominance);
+		printf(
+			"%s, fingerprint %016" PRIx64 ", %s\n",
+			huffman_styles[analysis.huffman], analysis.fingerprint, analysis.encoder
+		);
+	}
+
+	return (num_failed > 0) ? 1 : 0;
 }
 
 int main(int argc, char** argv)
 {
-	if (argc != 2)
+	if (argc < 2)
 	{
 		print_usage();
 		return 1;
 	}
 
+	if (strcmp(argv[1], "--validate") == 0)
+	{
+		if (argc < 3)
+		{
+			print_usage();
+			return 1;
+		}
+
+		return validate_files(argc - 2, argv + 2);
+	}
+
+	if (strcmp(argv[1], "--carve") == 0)
+	{
+		if (argc != 3)
+		{
+			print_usage();
+			return 1;
+		}
+
+		size_t num_images = carve_file(argv[2], print_carved_image, NULL);
+		if (num_images == (size_t)-1)
+		{
+			fprintf(stderr, "Failed to carve %s\n", argv[2]);
+			return 1;
+		}
+
+		printf("Found %zu image(s)\n", num_images);
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--export") == 0)
+	{
+		if (argc != 4)
+		{
+			print_usage();
+			return 1;
+		}
+
+		if (export_coefficients_file(argv[2], argv[3]) != 0)
+		{
+			fprintf(stderr, "Failed to export coefficients of %s\n", argv[2]);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--preview") == 0)
+	{
+		if (argc != 4)
+		{
+			print_usage();
+			return 1;
+		}
+
+		struct Preview preview;
+		if (load_preview(argv[3], (uint16_t)atoi(argv[2]), &preview) != 0)
+		{
+			fprintf(stderr, "Failed to create preview of %s\n", argv[3]);
+			return 1;
+		}
+
+		printf("%s: %s, %ux%u\n", argv[3], preview_source_name(preview.source), preview.image.width, preview.image.height);
+
+		free_preview(&preview);
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--hash") == 0)
+	{
+		if (argc < 3)
+		{
+			print_usage();
+			return 1;
+		}
+
+		// Only the DC coefficients are decoded
+		int num_failed = 0;
+		if (load_jpeg_batch_with_flags((const char**)(argv + 2), argc - 2, DEFAULT_MAX_IN_FLIGHT, LoadDecodeScans | LoadDCOnly, print_batch_hash, &num_failed) != 0)
+		{
+			fprintf(stderr, "Batch loading failed\n");
+			return 1;
+		}
+
+		return (num_failed > 0) ? 1 : 0;
+	}
+
+	if (strcmp(argv[1], "--analyze") == 0)
+	{
+		if (argc < 3)
+		{
+			print_usage();
+			return 1;
+		}
+
+		return analyze_files(argc - 2, argv + 2);
+	}
+
+	if (strcmp(argv[1], "--output") == 0)
+	{
+		enum OutputFormat format;
+		if (argc != 5 || parse_output_format(argv[2], &format) != 0)
+		{
+			print_usage();
+			return 1;
+		}
+
+		if (write_image_file(argv[3], format, 1, argv[4]) != 0)
+		{
+			fprintf(stderr, "Failed to write %s\n", argv[4]);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (argc > 2)
+	{
+		int num_failed = 0;
+		if (load_jpeg_batch((const char**)(argv + 1), argc - 1, DEFAULT_MAX_IN_FLIGHT, print_batch_result, &num_failed) != 0)
+		{
+			fprintf(stderr, "Batch loading failed\n");
+			return 1;
+		}
+
+		return (num_failed > 0) ? 1 : 0;
+	}
+
 	const char* filename = argv[1];
 	printf("Supplied file: %s\n", filename);
 
@@ -0,0 +1,395 @@
+#include "output.h"
+#include "render.h"
+#include "context.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory.h>
+#include <errno.h>
+#include <assert.h>
+
+#if defined(_MSC_VER)
+	#include <io.h>
+	#include <fcntl.h>
+
+	struct iovec
+	{
+		void* iov_base;
+		size_t iov_len;
+	};
+#else
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/uio.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+// A header plus one row of MCUs of a single plane (at most 4 blocks of 8 rows)
+#define OUTPUT_MAX_IOVECS (1 + 4 * 8)
+
+#define OUTPUT_HEADER_SIZE 128
+
+struct OutputState
+{
+	JPEG* jpeg;
+	int fd;
+	enum OutputFormat format;
+
+	char header[OUTPUT_HEADER_SIZE];
+	size_t header_size;
+	int header_written;
+
+	// Regular files are written at absolute offsets, everything else in order
+	int seekable;
+	long long base_offset;
+	long long plane_offsets[3];
+	size_t plane_sizes[3];
+	long long end_offset;
+
+	// Chroma planes held back for outputs that are not seekable
+	uint8_t* deferred_planes[3];
+};
+
+static int check_output_format(JPEG* jpeg, enum OutputFormat format);
+static int format_output_header(struct OutputState* state, const struct Strip* strip);
+static int write_strip(const struct Strip* strip, void* user_data);
+static int write_vector(int fd, struct iovec* iov, int count, long long offset);
+static int is_seekable(int fd, long long* offset);
+
+int write_image(JPEG* jpeg, enum OutputFormat format, unsigned scale, int fd)
+{
+	assert(jpeg);
+
+	if (check_output_format(jpeg, format) != 0)
+		return 1;
+
+	struct OutputState state;
+	memset(&state, 0, sizeof(struct OutputState));
+	state.jpeg = jpeg;
+	state.fd = fd;
+	state.format = format;
+	state.seekable = (format == OutputPlanar || format == OutputY4M) && is_seekable(fd, &state.base_offset);
+
+	enum RenderLayout layout = (format == OutputPlanar || format == OutputY4M) ? RenderPlanar : RenderInterleaved;
+	int result = render_strips(jpeg, scale, layout, write_strip, &state);
+
+	// Non-seekable planar output finishes with the planes that had to wait for the luma plane
+	for (size_t c = 1; c < 3 && result == 0; c++)
+	{
+		if (state.deferred_planes[c] == NULL)
+			continue;
+
+		struct iovec iov = { state.deferred_planes[c], state.plane_sizes[c] };
+		result = write_vector(fd, &iov, 1, -1);
+	}
+
+#if !defined(_MSC_VER)
+	// Leave the file position after the image, as if it had been written in order
+	if (result == 0 && state.seekable && lseek(fd, (off_t)state.end_offset, SEEK_SET) < 0)
+		result = 1;
+#endif
+
+	for (size_t c = 0; c < 3; c++)
+		jpeg_free(jpeg, state.deferred_planes[c]);
+
+	if (result != 0)
+	{
+		ERROR_LOG("Failed to write image");
+		return 1;
+	}
+
+	return 0;
+}
+
+int write_image_file(const char* jpeg_filename, enum OutputFormat format, unsigned scale, const char* output_filename)
+{
+	assert(jpeg_filename);
+	assert(output_filename);
+
+	JPEG* jpeg = load_jpeg_with_flags(jpeg_filename, LoadDecodeScans);
+	if (jpeg == NULL)
+	{
+		ERROR_LOG("Failed to load %s", jpeg_filename);
+		return 1;
+	}
+
+	// Rejects an unsupported format before the output file is truncated
+	if (check_output_format(jpeg, format) != 0)
+	{
+		free_jpeg(jpeg);
+		return 1;
+	}
+
+	int to_stdout = strcmp(output_filename, "-") == 0;
+
+#if defined(_MSC_VER)
+	int fd = to_stdout ? _fileno(stdout) : _open(output_filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+	int fd = to_stdout ? STDOUT_FILENO : open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+
+	if (fd < 0)
+	{
+		ERROR_LOG("Failed to open %s", output_filename);
+		free_jpeg(jpeg);
+		return 1;
+	}
+
+	int result = write_image(jpeg, format, scale, fd);
+
+#if defined(_MSC_VER)
+	if (!to_stdout && _close(fd) != 0)
+#else
+	if (!to_stdout && close(fd) != 0)
+#endif
+	{
+		ERROR_LOG("Failed to close %s", output_filename);
+		result = 1;
+	}
+
+	free_jpeg(jpeg);
+	return result;
+}
+
+int parse_output_format(const char* name, enum OutputFormat* format)
+{
+	assert(name);
+	assert(format);
+
+	if (strcmp(name, "ppm") == 0 || strcmp(name, "pgm") == 0)
+		*format = OutputPNM;
+	else if (strcmp(name, "rgb") == 0)
+		*format = OutputRGB;
+	else if (strcmp(name, "yuv") == 0)
+		*format = OutputPlanar;
+	else if (strcmp(name, "y4m") == 0)
+		*format = OutputY4M;
+	else
+		return 1;
+
+	return 0;
+}
+
+int check_output_format(JPEG* jpeg, enum OutputFormat format)
+{
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	if (frame_header == NULL || format != OutputY4M || frame_header->num_components == 1)
+		return 0;
+
+	// YUV4MPEG2 only knows a few chroma layouts, all with identical chroma components
+	struct FrameComponent* components = frame_header->components;
+	int identical_chroma = frame_header->num_components == 3 &&
+		components[1].sampling_factor.h == 1 && components[1].sampling_factor.v == 1 &&
+		components[2].sampling_factor.h == 1 && components[2].sampling_factor.v == 1;
+
+	unsigned h = components[0].sampling_factor.h;
+	unsigned v = components[0].sampling_factor.v;
+	int known_layout = (v == 1 && (h == 1 || h == 2 || h == 4)) || (v == 2 && h == 2);
+
+	if (!identical_chroma || !known_layout)
+	{
+		ERROR_LOG("The sampling factors of the image cannot be expressed in YUV4MPEG2");
+		return 1;
+	}
+
+	return 0;
+}
+
+int format_output_header(struct OutputState* state, const struct Strip* strip)
+{
+	struct FrameHeader* frame_header = state->jpeg->frame_header;
+	int length = 0;
+
+	if (state->format == OutputPNM)
+	{
+		length = snprintf(
+			state->header, OUTPUT_HEADER_SIZE, "P%c\n%u %u\n255\n",
+			(strip->num_channels == 1) ? '5' : '6', strip->width, strip->height
+		);
+	}
+	else if (state->format == OutputY4M)
+	{
+		const char* chroma = "mono";
+		if (frame_header->num_components == 3)
+		{
+			unsigned h = frame_header->components[0].sampling_factor.h;
+			unsigned v = frame_header->components[0].sampling_factor.v;
+			chroma = (v == 2) ? "420jpeg" : (h == 4) ? "411" : (h == 2) ? "422" : "444";
+		}
+
+		// JPEG samples use the full range
+		length = snprintf(
+			state->header, OUTPUT_HEADER_SIZE, "YUV4MPEG2 W%u H%u F1:1 Ip A1:1 C%s XCOLORRANGE=FULL\nFRAME\n",
+			strip->width, strip->height, chroma
+		);
+	}
+
+	if (length < 0 || length >= OUTPUT_HEADER_SIZE)
+		return 1;
+
+	state->header_size = (size_t)length;
+
+	// Planes follow each other without padding
+	long long offset = state->base_offset + (long long)state->header_size;
+	for (size_t c = 0; c < strip->num_planes; c++)
+	{
+		state->plane_offsets[c] = offset;
+		state->plane_sizes[c] = strip->planes[c].row_size * strip->planes[c].height;
+		offset += (long long)state->plane_sizes[c];
+	}
+
+	state->end_offset = offset;
+	return 0;
+}
+
+int write_strip(const struct Strip* strip, void* user_data)
+{
+	struct OutputState* state = (struct OutputState*)user_data;
+
+	struct iovec iov[OUTPUT_MAX_IOVECS];
+	int count = 0;
+
+	if (!state->header_written)
+	{
+		if (format_output_header(state, strip) != 0)
+			return 1;
+
+		if (state->header_size > 0)
+		{
+			iov[0].iov_base = state->header;
+			iov[0].iov_len = state->header_size;
+			count = 1;
+		}
+
+		state->header_written = 1;
+	}
+
+	if (state->seekable && count > 0)
+	{
+		if (write_vector(state->fd, iov, count, state->base_offset) != 0)
+			return 1;
+
+		count = 0;
+	}
+
+	for (size_t c = 0; c < strip->num_planes; c++)
+	{
+		const struct StripPlane* plane = strip->planes + c;
+		if (plane->num_rows == 0)
+			continue;
+
+		if (c > 0 && !state->seekable)
+		{
+			if (state->deferred_planes[c] == NULL)
+			{
+				state->deferred_planes[c] = (uint8_t*)jpeg_malloc(state->jpeg, plane->row_size * plane->height);
+				if (state->deferred_planes[c] == NULL)
+				{
+					ERROR_LOG("Failed to allocate memory for component plane");
+					return 1;
+				}
+			}
+
+			uint8_t* output = state->deferred_planes[c] + (size_t)plane->y * plane->row_size;
+			for (unsigned r = 0; r < plane->num_rows; r++)
+				memcpy(output + r * plane->row_size, plane->data + r * plane->stride, plane->row_size);
+
+			continue;
+		}
+
+		// Rows of interleaved strips are contiguous, plane rows are padded to whole blocks
+		if (plane->stride == plane->row_size)
+		{
+			iov[count].iov_base = (void*)plane->data;
+			iov[count].iov_len = plane->row_size * plane->num_rows;
+			count++;
+		}
+		else
+		{
+			for (unsigned r = 0; r < plane->num_rows; r++)
+			{
+				iov[count].iov_base = (void*)(plane->data + r * plane->stride);
+				iov[count].iov_len = plane->row_size;
+				count++;
+			}
+		}
+
+		if (state->seekable)
+		{
+			long long offset = state->plane_offsets[c] + (long long)plane->y * (long long)plane->row_size;
+			if (write_vector(state->fd, iov, count, offset) != 0)
+				return 1;
+
+			count = 0;
+		}
+	}
+
+	if (count > 0 && write_vector(state->fd, iov, count, -1) != 0)
+		return 1;
+
+	return 0;
+}
+
+// Writes everything, at offset unless it is negative
+int write_vector(int fd, struct iovec* iov, int count, long long offset)
+{
+	while (count > 0)
+	{
+#if defined(_MSC_VER)
+		int written = _write(fd, iov->iov_base, (unsigned)iov->iov_len);
+#else
+		ssize_t written = (offset < 0) ? writev(fd, iov, count) : pwritev(fd, iov, count, (off_t)offset);
+#endif
+
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return 1;
+		}
+
+		if (offset >= 0)
+			offset += written;
+
+		// Skip what has been written, which may end in the middle of a vector
+		size_t remaining = (size_t)written;
+		while (count > 0 && remaining >= iov->iov_len)
+		{
+			remaining -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0)
+		{
+			iov->iov_base = (uint8_t*)iov->iov_base + remaining;
+			iov->iov_len -= remaining;
+		}
+	}
+
+	return 0;
+}
+
+int is_seekable(int fd, long long* offset)
+{
+#if defined(_MSC_VER)
+	(void)fd;
+	(void)offset;
+
+	return 0;
+#else
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	off_t position = lseek(fd, 0, SEEK_CUR);
+	if (position < 0)
+		return 0;
+
+	*offset = (long long)position;
+	return 1;
+#endif
+}
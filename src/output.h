@@ -0,0 +1,27 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include "loader.h"
+
+enum OutputFormat
+{
+	OutputPNM,		// Binary PPM for color, PGM for grayscale images
+	OutputRGB,		// Raw interleaved RGB (or grayscale) samples
+	OutputPlanar,	// Raw component planes at their own resolution, one after another
+	OutputY4M		// Single YUV4MPEG2 frame, full range
+};
+
+// Writes the image to fd one row of MCUs at a time, straight from the render buffers. Regular
+// files get every row at its final offset, so planar formats need no copy of the image. Other
+// outputs are written strictly in order, which means the chroma planes of planar formats have
+// to be held back until the luma plane is complete. The image must have been loaded with
+// LoadDecodeScans; scale is 1, 2, 4 or 8.
+int write_image(JPEG* jpeg, enum OutputFormat format, unsigned scale, int fd);
+
+// Writes to stdout if output_filename is "-"
+int write_image_file(const char* jpeg_filename, enum OutputFormat format, unsigned scale, const char* output_filename);
+
+// Accepts "ppm" (or "pgm"), "rgb", "yuv" and "y4m"
+int parse_output_format(const char* name, enum OutputFormat* format);
+
+#endif // _OUTPUT_H
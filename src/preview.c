@@ -0,0 +1,308 @@
+#include "preview.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#define JFXX_JPEG_THUMBNAIL 0x10
+#define JFXX_PALETTE_THUMBNAIL 0x11
+#define JFXX_RGB_THUMBNAIL 0x13
+
+#define EXIF_TAG_JPEG_OFFSET 0x0201
+#define EXIF_TAG_JPEG_LENGTH 0x0202
+
+static int load_jfif_preview(JPEG* jpeg, unsigned target, struct Preview* preview);
+static int load_jfxx_preview(JPEG* jpeg, unsigned target, struct Preview* preview);
+static int load_exif_preview(JPEG* jpeg, unsigned target, struct Preview* preview);
+static int load_jpeg_thumbnail(const uint8_t* data, size_t size, unsigned target, struct Preview* preview);
+static int load_reduced_preview(JPEG* jpeg, unsigned target, struct Preview* preview);
+
+static int is_large_enough(unsigned width, unsigned height, unsigned target)
+{
+	return ((width > height) ? width : height) >= target;
+}
+
+int load_preview(const char* filename, uint16_t size, struct Preview* preview)
+{
+	assert(filename);
+	assert(preview);
+
+	memset(preview, 0, sizeof(struct Preview));
+	preview->scale = 1;
+
+	// Entropy-coded data is skipped, so finding the thumbnails only touches the headers
+	JPEG* jpeg = load_jpeg(filename);
+	if (jpeg == NULL)
+	{
+		ERROR_LOG("Failed to load %s", filename);
+		return 1;
+	}
+
+	if (jpeg->frame_header == NULL)
+	{
+		ERROR_LOG("%s has no frame", filename);
+		free_jpeg(jpeg);
+		return 1;
+	}
+
+	unsigned width = jpeg->frame_header->num_samples;
+	unsigned height = jpeg->frame_header->num_lines;
+	unsigned target = size;
+	if (!is_large_enough(width, height, target))
+		target = (width > height) ? width : height;
+
+	int result = 0;
+
+	// Cheapest sources first: raw RGB thumbnails, then small JPEG thumbnails
+	if (load_jfif_preview(jpeg, target, preview) != 0 &&
+		load_jfxx_preview(jpeg, target, preview) != 0 &&
+		load_exif_preview(jpeg, target, preview) != 0)
+	{
+		result = load_reduced_preview(jpeg, target, preview);
+		if (result != 0)
+		{
+			ERROR_LOG("Failed to decode %s", filename);
+		}
+	}
+
+	free_jpeg(jpeg);
+	return result;
+}
+
+void free_preview(struct Preview* preview)
+{
+	if (preview == NULL)
+		return;
+
+	free_image(&preview->image);
+}
+
+const char* preview_source_name(enum PreviewSource source)
+{
+	switch (source)
+	{
+	case PreviewJFIFThumbnail:	return "JFIF thumbnail";
+	case PreviewJFXXThumbnail:	return "JFXX thumbnail";
+	case PreviewExifThumbnail:	return "EXIF thumbnail";
+	case PreviewFullDecode:		return "full decode";
+	default:					return "reduced decode";
+	}
+}
+
+int load_jfif_preview(JPEG* jpeg, unsigned target, struct Preview* preview)
+{
+	if (jpeg->app0 == NULL || !is_large_enough(jpeg->app0->thumbnail_x, jpeg->app0->thumbnail_y, target))
+		return 1;
+
+	uint8_t* thumbnail = load_jfif_thumbnail(jpeg);
+	if (thumbnail == NULL)
+		return 1;
+
+	size_t size = (size_t)jpeg->app0->thumbnail_x * jpeg->app0->thumbnail_y * 3;
+	preview->image.data = (uint8_t*)malloc(size);
+	if (preview->image.data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for preview");
+		return 1;
+	}
+
+	memcpy(preview->image.data, thumbnail, size);
+	preview->image.width = jpeg->app0->thumbnail_x;
+	preview->image.height = jpeg->app0->thumbnail_y;
+	preview->image.num_channels = 3;
+	preview->source = PreviewJFIFThumbnail;
+
+	return 0;
+}
+
+int load_jfxx_preview(JPEG* jpeg, unsigned target, struct Preview* preview)
+{
+	// "JFXX\0" followed by the extension code
+	static const size_t jfxx_header_size = 6;
+
+	const struct Segment* segment = find_app_segment(jpeg, 0, "JFXX");
+	if (segment == NULL || segment->length < jfxx_header_size + 2)
+		return 1;
+
+	uint8_t* data = read_segment(jpeg, segment);
+	if (data == NULL)
+		return 1;
+
+	uint8_t code = data[jfxx_header_size - 1];
+	const uint8_t* payload = data + jfxx_header_size;
+	size_t payload_size = segment->length - jfxx_header_size;
+
+	if (code == JFXX_JPEG_THUMBNAIL)
+	{
+		int result = load_jpeg_thumbnail(payload, payload_size, target, preview);
+		if (result == 0)
+			preview->source = PreviewJFXXThumbnail;
+
+		free(data);
+		return result;
+	}
+
+	// Palette and RGB thumbnails start with their dimensions
+	uint8_t width = payload[0];
+	uint8_t height = payload[1];
+	size_t num_pixels = (size_t)width * height;
+
+	size_t expected_size = 2 + ((code == JFXX_PALETTE_THUMBNAIL) ? 768 + num_pixels : num_pixels * 3);
+	if ((code != JFXX_PALETTE_THUMBNAIL && code != JFXX_RGB_THUMBNAIL) || payload_size < expected_size ||
+		num_pixels == 0 || !is_large_enough(width, height, target))
+	{
+		free(data);
+		return 1;
+	}
+
+	preview->image.data = (uint8_t*)malloc(num_pixels * 3);
+	if (preview->image.data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for preview");
+		free(data);
+		return 1;
+	}
+
+	if (code == JFXX_RGB_THUMBNAIL)
+	{
+		memcpy(preview->image.data, payload + 2, num_pixels * 3);
+	}
+	else
+	{
+		const uint8_t* palette = payload + 2;
+		const uint8_t* indices = palette + 768;
+
+		for (size_t i = 0; i < num_pixels; i++)
+			memcpy(preview->image.data + i * 3, palette + (size_t)indices[i] * 3, 3);
+	}
+
+	preview->image.width = width;
+	preview->image.height = height;
+	preview->image.num_channels = 3;
+	preview->source = PreviewJFXXThumbnail;
+
+	free(data);
+	return 0;
+}
+
+static uint32_t read_tiff(const uint8_t* data, int little_endian, int size)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < size; i++)
+		value |= (uint32_t)data[i] << (8 * (little_endian ? i : size - 1 - i));
+
+	return value;
+}
+
+int load_exif_preview(JPEG* jpeg, unsigned target, struct Preview* preview)
+{
+	size_t size;
+	uint8_t* exif = load_exif(jpeg, &size);
+	if (exif == NULL)
+		return 1;
+
+	// TIFF header: byte order, 42, offset of IFD0
+	int result = 1;
+	int little_endian = size >= 8 && exif[0] == 'I' && exif[1] == 'I';
+	if (size < 8 || (!little_endian && (exif[0] != 'M' || exif[1] != 'M')) || read_tiff(exif + 2, little_endian, 2) != 42)
+	{
+		free(exif);
+		return 1;
+	}
+
+	// IFD1, which describes the thumbnail, follows IFD0
+	uint32_t ifd = read_tiff(exif + 4, little_endian, 4);
+	if (ifd > size - 2)
+	{
+		free(exif);
+		return 1;
+	}
+
+	uint32_t num_entries = read_tiff(exif + ifd, little_endian, 2);
+	if (ifd + 2 + (size_t)num_entries * 12 + 4 > size)
+	{
+		free(exif);
+		return 1;
+	}
+
+	ifd = read_tiff(exif + ifd + 2 + num_entries * 12, little_endian, 4);
+	if (ifd == 0 || ifd > size - 2)
+	{
+		free(exif);
+		return 1;
+	}
+
+	num_entries = read_tiff(exif + ifd, little_endian, 2);
+	if (ifd + 2 + (size_t)num_entries * 12 > size)
+	{
+		free(exif);
+		return 1;
+	}
+
+	uint32_t thumbnail_offset = 0;
+	uint32_t thumbnail_length = 0;
+
+	for (uint32_t i = 0; i < num_entries; i++)
+	{
+		const uint8_t* entry = exif + ifd + 2 + i * 12;
+		uint16_t tag = (uint16_t)read_tiff(entry, little_endian, 2);
+
+		if (tag == EXIF_TAG_JPEG_OFFSET)
+			thumbnail_offset = read_tiff(entry + 8, little_endian, 4);
+		else if (tag == EXIF_TAG_JPEG_LENGTH)
+			thumbnail_length = read_tiff(entry + 8, little_endian, 4);
+	}
+
+	if (thumbnail_offset != 0 && thumbnail_length != 0 && thumbnail_offset <= size && thumbnail_length <= size - thumbnail_offset)
+	{
+		result = load_jpeg_thumbnail(exif + thumbnail_offset, thumbnail_length, target, preview);
+		if (result == 0)
+			preview->source = PreviewExifThumbnail;
+	}
+
+	free(exif);
+	return result;
+}
+
+int load_jpeg_thumbnail(const uint8_t* data, size_t size, unsigned target, struct Preview* preview)
+{
+	// Check the size before paying for the decode
+	JPEG* thumbnail = load_jpeg_memory(data, size);
+	if (thumbnail == NULL)
+		return 1;
+
+	int usable = thumbnail->frame_header != NULL &&
+		is_large_enough(thumbnail->frame_header->num_samples, thumbnail->frame_header->num_lines, target);
+
+	// Decoded from the same stream, like the main image in load_reduced_preview()
+	int result = 1;
+	if (usable && reload_jpeg(thumbnail, LoadDecodeScans) == 0)
+		result = render_jpeg(thumbnail, 1, &preview->image);
+
+	free_jpeg(thumbnail);
+	return result;
+}
+
+int load_reduced_preview(JPEG* jpeg, unsigned target, struct Preview* preview)
+{
+	unsigned width = jpeg->frame_header->num_samples;
+	unsigned height = jpeg->frame_header->num_lines;
+
+	unsigned scale = 8;
+	while (scale > 1 && !is_large_enough((width + scale - 1) / scale, (height + scale - 1) / scale, target))
+		scale /= 2;
+
+	// The indexed image is parsed again from its open stream, this time with the scans.
+	// At 1/8 every block becomes one sample, so only the DC coefficients are needed.
+	if (reload_jpeg(jpeg, LoadDecodeScans | ((scale == 8) ? LoadDCOnly : 0)) != 0)
+		return 1;
+
+	int result = render_jpeg(jpeg, scale, &preview->image);
+	if (result == 0)
+	{
+		preview->source = (scale == 1) ? PreviewFullDecode : PreviewReducedDecode;
+		preview->scale = scale;
+	}
+
+	return result;
+}
@@ -0,0 +1,33 @@
+#ifndef _PREVIEW_H
+#define _PREVIEW_H
+
+#include "loader.h"
+#include "render.h"
+
+enum PreviewSource
+{
+	PreviewJFIFThumbnail,
+	PreviewJFXXThumbnail,
+	PreviewExifThumbnail,
+	PreviewReducedDecode,
+	PreviewFullDecode
+};
+
+struct Preview
+{
+	enum PreviewSource source;
+	unsigned scale;			// Reduction of the main image, 1 for thumbnails
+	struct Image image;
+};
+
+// Produces the cheapest image that is at least size pixels along its longer edge, or the whole
+// image if that is smaller. Embedded thumbnails (JFIF, JFXX and EXIF IFD1) are found without
+// decoding the main scans and used if they are large enough. Otherwise the main image is decoded
+// at the largest reduction that still covers the size, DC-only at 1/8, or in full if none does.
+// Callers scale the result down to fit.
+int load_preview(const char* filename, uint16_t size, struct Preview* preview);
+void free_preview(struct Preview* preview);
+
+const char* preview_source_name(enum PreviewSource source);
+
+#endif // _PREVIEW_H
@@ -0,0 +1,630 @@
+#include "render.h"
+#include "decoder.h"
+#include "context.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <math.h>
+#include <assert.h>
+
+#ifndef M_PI
+	#define M_PI 3.14159265358979323846
+#endif
+
+struct RenderComponent
+{
+	struct FrameComponent* frame_component;
+	struct ComponentCoefficients* coefficients;
+
+	float table[64];	// Dequantization, including the IDCT scaling
+
+	// Subsampled components are transformed to more samples per block, so that they need
+	// as little upsampling as possible. Planar output keeps their own resolution.
+	unsigned block_width;
+	unsigned block_height;
+
+	uint8_t* plane;		// Samples of one row of MCUs
+	size_t plane_width;
+	uint32_t* columns;	// Plane column of every output column, NULL for planar output
+
+	// Size of the whole plane for planar output
+	size_t row_size;
+	uint16_t height;
+};
+
+struct RenderState
+{
+	JPEG* jpeg;				// Buffers are allocated from the image's context
+
+	unsigned scale;
+	unsigned block_size;
+	unsigned mcu_rows;		// Output rows per row of MCUs
+	enum RenderLayout layout;
+	float basis[4][8][8];	// IDCT basis for 1, 2, 4 and 8 samples, indexed by sample and frequency
+
+	uint16_t width;
+	uint16_t height;
+	uint8_t num_channels;
+
+	size_t num_components;
+	struct RenderComponent components[3];
+	int rgb;
+};
+
+static int render(JPEG* jpeg, unsigned scale, enum RenderLayout layout, uint8_t* destination, StripCallback callback, void* user_data);
+static int init_render_state(JPEG* jpeg, unsigned scale, enum RenderLayout layout, struct RenderState* state);
+static int prepare_component(JPEG* jpeg, struct RenderState* state, struct RenderComponent* component, size_t index);
+static void free_render_state(struct RenderState* state);
+
+static void transform_mcu_row(const struct RenderState* state, unsigned mcu_y);
+static void convert_rows(const struct RenderState* state, unsigned first_row, unsigned num_rows, uint8_t* output);
+
+static void transform_block(const struct RenderState* state, const struct RenderComponent* component, const int16_t* block, uint8_t* output);
+static void idct_8x8(const int16_t* block, const float* table, uint8_t* output, size_t stride);
+static void idct_reduced(const struct RenderState* state, const struct RenderComponent* component, const int16_t* block, uint8_t* output);
+
+static inline uint8_t clamp_sample(int value)
+{
+	return (uint8_t)((value < 0) ? 0 : (value > 255) ? 255 : value);
+}
+
+static unsigned basis_index(unsigned size)
+{
+	return (size == 1) ? 0 : (size == 2) ? 1 : (size == 4) ? 2 : 3;
+}
+
+int render_jpeg(JPEG* jpeg, unsigned scale, struct Image* image)
+{
+	assert(jpeg);
+	assert(image);
+
+	memset(image, 0, sizeof(struct Image));
+
+	if (jpeg->frame_header == NULL)
+	{
+		ERROR_LOG("No decoded coefficients to render, the image has to be loaded with LoadDecodeScans");
+		return 1;
+	}
+
+	image->width = (uint16_t)((jpeg->frame_header->num_samples + scale - 1) / scale);
+	image->height = (uint16_t)((jpeg->frame_header->num_lines + scale - 1) / scale);
+	image->num_channels = (jpeg->frame_header->num_components == 1) ? 1 : 3;
+
+	image->data = (uint8_t*)malloc((size_t)image->width * image->height * image->num_channels);
+	if (image->data == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for image");
+		return 1;
+	}
+
+	if (render(jpeg, scale, RenderInterleaved, image->data, NULL, NULL) != 0)
+	{
+		free_image(image);
+		return 1;
+	}
+
+	return 0;
+}
+
+int render_strips(JPEG* jpeg, unsigned scale, enum RenderLayout layout, StripCallback callback, void* user_data)
+{
+	assert(jpeg);
+	assert(callback);
+
+	return render(jpeg, scale, layout, NULL, callback, user_data);
+}
+
+void free_image(struct Image* image)
+{
+	if (image == NULL)
+		return;
+
+	free(image->data);
+	image->data = NULL;
+}
+
+int render(JPEG* jpeg, unsigned scale, enum RenderLayout layout, uint8_t* destination, StripCallback callback, void* user_data)
+{
+	struct RenderState render_state;
+	struct RenderState* state = &render_state;
+
+	if (init_render_state(jpeg, scale, layout, state) != 0)
+	{
+		free_render_state(state);
+		return 1;
+	}
+
+	unsigned mcu_rows = state->mcu_rows;
+	size_t row_size = (size_t)state->width * state->num_channels;
+
+	// Without a destination, interleaved rows are converted into a buffer for one row of MCUs
+	uint8_t* strip_buffer = NULL;
+	if (destination == NULL && layout == RenderInterleaved)
+	{
+		strip_buffer = (uint8_t*)jpeg_malloc(jpeg, row_size * mcu_rows);
+		if (strip_buffer == NULL)
+		{
+			ERROR_LOG("Failed to allocate memory for strip");
+			free_render_state(state);
+			return 1;
+		}
+	}
+
+	struct Strip strip;
+	memset(&strip, 0, sizeof(struct Strip));
+	strip.width = state->width;
+	strip.height = state->height;
+	strip.num_channels = state->num_channels;
+
+	int result = 0;
+
+	uint16_t mcus_y = mcu_lines(jpeg->frame_header);
+	for (unsigned mcu_y = 0; mcu_y < mcus_y && result == 0; mcu_y++)
+	{
+		transform_mcu_row(state, mcu_y);
+
+		if (layout == RenderInterleaved)
+		{
+			unsigned first_row = mcu_y * mcu_rows;
+			if (first_row >= state->height)
+				break;
+
+			unsigned num_rows = (state->height - first_row < mcu_rows) ? state->height - first_row : mcu_rows;
+
+			if (destination != NULL)
+			{
+				convert_rows(state, first_row, num_rows, destination + first_row * row_size);
+				continue;
+			}
+
+			convert_rows(state, first_row, num_rows, strip_buffer);
+
+			strip.num_planes = 1;
+			strip.planes[0].data = strip_buffer;
+			strip.planes[0].stride = row_size;
+			strip.planes[0].row_size = row_size;
+			strip.planes[0].height = state->height;
+			strip.planes[0].y = (uint16_t)first_row;
+			strip.planes[0].num_rows = (uint16_t)num_rows;
+		}
+		else
+		{
+			strip.num_planes = state->num_components;
+
+			for (size_t c = 0; c < state->num_components; c++)
+			{
+				const struct RenderComponent* component = state->components + c;
+				unsigned plane_rows = component->frame_component->sampling_factor.v * component->block_height;
+				unsigned first_row = mcu_y * plane_rows;
+
+				struct StripPlane* plane = strip.planes + c;
+				plane->data = component->plane;
+				plane->stride = component->plane_width;
+				plane->row_size = component->row_size;
+				plane->height = component->height;
+				plane->y = (uint16_t)first_row;
+				plane->num_rows = (first_row >= component->height) ? 0 :
+					(uint16_t)((component->height - first_row < plane_rows) ? component->height - first_row : plane_rows);
+			}
+		}
+
+		result = callback(&strip, user_data);
+	}
+
+	jpeg_free(jpeg, strip_buffer);
+	free_render_state(state);
+
+	return result;
+}
+
+int init_render_state(JPEG* jpeg, unsigned scale, enum RenderLayout layout, struct RenderState* state)
+{
+	memset(state, 0, sizeof(struct RenderState));
+	state->jpeg = jpeg;
+
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	if (frame_header == NULL || jpeg->coefficients == NULL)
+	{
+		ERROR_LOG("No decoded coefficients to render, the image has to be loaded with LoadDecodeScans");
+		return 1;
+	}
+
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+	{
+		ERROR_LOG("Unsupported scale 1/%u", scale);
+		return 1;
+	}
+
+	if (frame_header->num_components != 1 && frame_header->num_components != 3)
+	{
+		ERROR_LOG("Rendering images with %u components is not supported", frame_header->num_components);
+		return 1;
+	}
+
+	if (frame_header->precision != 8)
+	{
+		ERROR_LOG("Rendering %u-bit samples is not supported", frame_header->precision);
+		return 1;
+	}
+
+	state->scale = scale;
+	state->block_size = 8 / scale;
+	state->mcu_rows = frame_header->max_sampling_factor.v * state->block_size;
+	state->layout = layout;
+	state->num_components = frame_header->num_components;
+
+	// Reduced transforms evaluate the lowest frequencies at the reduced sample positions
+	for (unsigned size = 1; size <= 8; size *= 2)
+	{
+		for (unsigned x = 0; x < size; x++)
+		{
+			for (unsigned u = 0; u < size; u++)
+			{
+				float c = (u == 0) ? (float)(1.0 / sqrt(2.0)) : 1.0f;
+				state->basis[basis_index(size)][x][u] = 0.5f * c * (float)cos((2 * x + 1) * u * M_PI / (2.0 * size));
+			}
+		}
+	}
+
+	// Adobe-style RGB images are marked by their component identifiers
+	state->rgb = frame_header->num_components == 3 &&
+		frame_header->components[0].identifier == 'R' &&
+		frame_header->components[1].identifier == 'G' &&
+		frame_header->components[2].identifier == 'B';
+
+	state->width = (uint16_t)((frame_header->num_samples + scale - 1) / scale);
+	state->height = (uint16_t)((frame_header->num_lines + scale - 1) / scale);
+	state->num_channels = (frame_header->num_components == 1) ? 1 : 3;
+
+	for (size_t c = 0; c < state->num_components; c++)
+	{
+		if (prepare_component(jpeg, state, state->components + c, c) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+void transform_mcu_row(const struct RenderState* state, unsigned mcu_y)
+{
+	for (size_t c = 0; c < state->num_components; c++)
+	{
+		const struct RenderComponent* component = state->components + c;
+		unsigned v = component->frame_component->sampling_factor.v;
+
+		for (unsigned block_y = 0; block_y < v; block_y++)
+		{
+			size_t row = (size_t)mcu_y * v + block_y;
+			const int16_t* block = component->coefficients->data + row * component->coefficients->blocks_x * 64;
+			uint8_t* output = component->plane + (size_t)block_y * component->block_height * component->plane_width;
+
+			for (unsigned x = 0; x < component->coefficients->blocks_x; x++)
+			{
+				transform_block(state, component, block, output);
+
+				block += 64;
+				output += component->block_width;
+			}
+		}
+	}
+}
+
+void convert_rows(const struct RenderState* state, unsigned first_row, unsigned num_rows, uint8_t* output)
+{
+	(void)first_row;
+
+	// The planes hold the row of MCUs that starts at first_row
+	assert(first_row % state->mcu_rows == 0);
+	assert(num_rows <= state->mcu_rows);
+
+	for (unsigned r = 0; r < num_rows; r++)
+	{
+		const uint8_t* samples[3];
+		for (size_t c = 0; c < state->num_components; c++)
+		{
+			const struct RenderComponent* component = state->components + c;
+			unsigned plane_rows = component->frame_component->sampling_factor.v * component->block_height;
+			samples[c] = component->plane + (size_t)(r * plane_rows / state->mcu_rows) * component->plane_width;
+		}
+
+		if (state->num_components == 1)
+		{
+			const uint32_t* columns = state->components[0].columns;
+			for (size_t x = 0; x < state->width; x++)
+				output[x] = samples[0][columns[x]];
+
+			output += state->width;
+			continue;
+		}
+
+		const uint32_t* columns[3] = { state->components[0].columns, state->components[1].columns, state->components[2].columns };
+
+		for (size_t x = 0; x < state->width; x++)
+		{
+			int y_value = samples[0][columns[0][x]];
+			int cb = samples[1][columns[1][x]];
+			int cr = samples[2][columns[2][x]];
+
+			if (state->rgb)
+			{
+				output[0] = (uint8_t)y_value;
+				output[1] = (uint8_t)cb;
+				output[2] = (uint8_t)cr;
+			}
+			else
+			{
+				// JFIF YCbCr to RGB in 16-bit fixed point
+				cb -= 128;
+				cr -= 128;
+
+				output[0] = clamp_sample(y_value + ((91881 * cr + 32768) >> 16));
+				output[1] = clamp_sample(y_value + ((-22554 * cb - 46802 * cr + 32768) >> 16));
+				output[2] = clamp_sample(y_value + ((116130 * cb + 32768) >> 16));
+			}
+
+			output += 3;
+		}
+	}
+}
+
+int prepare_component(JPEG* jpeg, struct RenderState* state, struct RenderComponent* component, size_t index)
+{
+	struct FrameHeader* frame_header = jpeg->frame_header;
+
+	component->frame_component = frame_header->components + index;
+	component->coefficients = jpeg->coefficients + index;
+
+	const struct QuantizationTable* table = find_quantization_table(jpeg, component->frame_component->quantization_table);
+	if (table == NULL)
+	{
+		ERROR_LOG("Component %u uses undefined quantization table %u", component->frame_component->identifier, component->frame_component->quantization_table);
+		return 1;
+	}
+
+	uint16_t values[64];
+	get_quantization_values(table, values);
+
+	unsigned h = component->frame_component->sampling_factor.h;
+	unsigned v = component->frame_component->sampling_factor.v;
+	unsigned max_h = frame_header->max_sampling_factor.h;
+	unsigned max_v = frame_header->max_sampling_factor.v;
+
+	// Like libjpeg's DCT scaling, subsampled components get larger transforms where the factors allow it
+	component->block_width = state->block_size;
+	component->block_height = state->block_size;
+
+	if (state->layout == RenderInterleaved)
+	{
+		while (component->block_width < 8 && component->block_width * h * 2 <= state->block_size * max_h)
+			component->block_width *= 2;
+
+		while (component->block_height < 8 && component->block_height * v * 2 <= state->block_size * max_v)
+			component->block_height *= 2;
+	}
+
+	// The AAN transform expects its scale factors folded into the table (ITU T.81 scaling by 1/8 included)
+	static const double aan_scale[8] = { 1.0, 1.387039845, 1.306562965, 1.175875602, 1.0, 0.785694958, 0.541196100, 0.275899379 };
+	int full_transform = component->block_width == 8 && component->block_height == 8;
+
+	for (int i = 0; i < 64; i++)
+	{
+		component->table[i] = full_transform ?
+			(float)(values[i] * aan_scale[i / 8] * aan_scale[i % 8] / 8.0) :
+			(float)values[i];
+	}
+
+	component->plane_width = (size_t)component->coefficients->blocks_x * component->block_width;
+	component->plane = (uint8_t*)jpeg_malloc(jpeg, component->plane_width * v * component->block_height);
+	if (component->plane == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for component %u samples", component->frame_component->identifier);
+		return 1;
+	}
+
+	if (state->layout == RenderPlanar)
+	{
+		// Component dimensions as in ITU T.81 A.1.1, rounded up again for the reduction
+		size_t samples_x = ((size_t)frame_header->num_samples * h + max_h - 1) / max_h;
+		size_t lines_y = ((size_t)frame_header->num_lines * v + max_v - 1) / max_v;
+
+		component->row_size = (samples_x + state->scale - 1) / state->scale;
+		component->height = (uint16_t)((lines_y + state->scale - 1) / state->scale);
+
+		return 0;
+	}
+
+	component->columns = (uint32_t*)jpeg_malloc(jpeg, sizeof(uint32_t) * (state->width > 0 ? state->width : 1));
+	if (component->columns == NULL)
+	{
+		ERROR_LOG("Failed to allocate memory for component %u samples", component->frame_component->identifier);
+		return 1;
+	}
+
+	// Whatever resolution is still missing is made up by repeating samples
+	size_t plane_columns = (size_t)h * component->block_width;
+	size_t mcu_columns = (size_t)max_h * state->block_size;
+	for (size_t x = 0; x < state->width; x++)
+		component->columns[x] = (uint32_t)(x * plane_columns / mcu_columns);
+
+	return 0;
+}
+
+void free_render_state(struct RenderState* state)
+{
+	for (size_t c = 0; c < state->num_components; c++)
+	{
+		jpeg_free(state->jpeg, state->components[c].plane);
+		jpeg_free(state->jpeg, state->components[c].columns);
+	}
+}
+
+void transform_block(const struct RenderState* state, const struct RenderComponent* component, const int16_t* block, uint8_t* output)
+{
+	if (component->block_width == 8 && component->block_height == 8)
+	{
+		idct_8x8(block, component->table, output, component->plane_width);
+	}
+	else if (component->block_width == 1 && component->block_height == 1)
+	{
+		// The DC coefficient is eight times the block average
+		output[0] = clamp_sample((int)floorf(block[0] * component->table[0] / 8.0f + 128.5f));
+	}
+	else
+	{
+		idct_reduced(state, component, block, output);
+	}
+}
+
+void idct_8x8(const int16_t* block, const float* table, uint8_t* output, size_t stride)
+{
+	// Floating point AAN IDCT (Arai, Agui, Nakajima), columns first
+	float workspace[64];
+
+	for (int column = 0; column < 8; column++)
+	{
+		const int16_t* in = block + column;
+		const float* q = table + column;
+		float* ws = workspace + column;
+
+		if (in[8] == 0 && in[16] == 0 && in[24] == 0 && in[32] == 0 && in[40] == 0 && in[48] == 0 && in[56] == 0)
+		{
+			float dc = in[0] * q[0];
+			for (int i = 0; i < 8; i++)
+				ws[i * 8] = dc;
+
+			continue;
+		}
+
+		// Even part
+		float tmp0 = in[0] * q[0];
+		float tmp1 = in[16] * q[16];
+		float tmp2 = in[32] * q[32];
+		float tmp3 = in[48] * q[48];
+
+		float tmp10 = tmp0 + tmp2;
+		float tmp11 = tmp0 - tmp2;
+		float tmp13 = tmp1 + tmp3;
+		float tmp12 = (tmp1 - tmp3) * 1.414213562f - tmp13;
+
+		tmp0 = tmp10 + tmp13;
+		tmp3 = tmp10 - tmp13;
+		tmp1 = tmp11 + tmp12;
+		tmp2 = tmp11 - tmp12;
+
+		// Odd part
+		float tmp4 = in[8] * q[8];
+		float tmp5 = in[24] * q[24];
+		float tmp6 = in[40] * q[40];
+		float tmp7 = in[56] * q[56];
+
+		float z13 = tmp6 + tmp5;
+		float z10 = tmp6 - tmp5;
+		float z11 = tmp4 + tmp7;
+		float z12 = tmp4 - tmp7;
+
+		tmp7 = z11 + z13;
+		tmp11 = (z11 - z13) * 1.414213562f;
+
+		float z5 = (z10 + z12) * 1.847759065f;
+		tmp10 = z5 - z12 * 1.082392200f;
+		tmp12 = z5 - z10 * 2.613125930f;
+
+		tmp6 = tmp12 - tmp7;
+		tmp5 = tmp11 - tmp6;
+		tmp4 = tmp10 - tmp5;
+
+		ws[0] = tmp0 + tmp7;
+		ws[56] = tmp0 - tmp7;
+		ws[8] = tmp1 + tmp6;
+		ws[48] = tmp1 - tmp6;
+		ws[16] = tmp2 + tmp5;
+		ws[40] = tmp2 - tmp5;
+		ws[24] = tmp3 + tmp4;
+		ws[32] = tmp3 - tmp4;
+	}
+
+	for (int row = 0; row < 8; row++)
+	{
+		const float* ws = workspace + row * 8;
+		uint8_t* out = output + row * stride;
+
+		// Level shift and rounding are folded into the DC term
+		float z5 = ws[0] + 128.5f;
+
+		float tmp10 = z5 + ws[4];
+		float tmp11 = z5 - ws[4];
+		float tmp13 = ws[2] + ws[6];
+		float tmp12 = (ws[2] - ws[6]) * 1.414213562f - tmp13;
+
+		float tmp0 = tmp10 + tmp13;
+		float tmp3 = tmp10 - tmp13;
+		float tmp1 = tmp11 + tmp12;
+		float tmp2 = tmp11 - tmp12;
+
+		float z13 = ws[5] + ws[3];
+		float z10 = ws[5] - ws[3];
+		float z11 = ws[1] + ws[7];
+		float z12 = ws[1] - ws[7];
+
+		float tmp7 = z11 + z13;
+		tmp11 = (z11 - z13) * 1.414213562f;
+
+		z5 = (z10 + z12) * 1.847759065f;
+		tmp10 = z5 - z12 * 1.082392200f;
+		tmp12 = z5 - z10 * 2.613125930f;
+
+		float tmp6 = tmp12 - tmp7;
+		float tmp5 = tmp11 - tmp6;
+		float tmp4 = tmp10 - tmp5;
+
+		out[0] = clamp_sample((int)(tmp0 + tmp7));
+		out[7] = clamp_sample((int)(tmp0 - tmp7));
+		out[1] = clamp_sample((int)(tmp1 + tmp6));
+		out[6] = clamp_sample((int)(tmp1 - tmp6));
+		out[2] = clamp_sample((int)(tmp2 + tmp5));
+		out[5] = clamp_sample((int)(tmp2 - tmp5));
+		out[3] = clamp_sample((int)(tmp3 + tmp4));
+		out[4] = clamp_sample((int)(tmp3 - tmp4));
+	}
+}
+
+void idct_reduced(const struct RenderState* state, const struct RenderComponent* component, const int16_t* block, uint8_t* output)
+{
+	unsigned width = component->block_width;
+	unsigned height = component->block_height;
+
+	const float (*basis_x)[8] = state->basis[basis_index(width)];
+	const float (*basis_y)[8] = state->basis[basis_index(height)];
+
+	// Only the lowest height x width frequencies contribute, rows first
+	float workspace[8][8];
+	for (unsigned v = 0; v < height; v++)
+	{
+		float coefficients[8];
+		for (unsigned u = 0; u < width; u++)
+			coefficients[u] = block[v * 8 + u] * component->table[v * 8 + u];
+
+		for (unsigned x = 0; x < width; x++)
+		{
+			float sum = 0.0f;
+			for (unsigned u = 0; u < width; u++)
+				sum += basis_x[x][u] * coefficients[u];
+
+			workspace[v][x] = sum;
+		}
+	}
+
+	for (unsigned y = 0; y < height; y++)
+	{
+		uint8_t* out = output + y * component->plane_width;
+
+		for (unsigned x = 0; x < width; x++)
+		{
+			float sum = 128.5f;
+			for (unsigned v = 0; v < height; v++)
+				sum += basis_y[y][v] * workspace[v][x];
+
+			out[x] = clamp_sample((int)floorf(sum));
+		}
+	}
+}
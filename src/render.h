@@ -0,0 +1,57 @@
+#ifndef _RENDER_H
+#define _RENDER_H
+
+#include "loader.h"
+
+struct Image
+{
+	uint16_t width;
+	uint16_t height;
+	uint8_t num_channels;	// 1 for grayscale, 3 for RGB
+	uint8_t* data;			// Rows of width * num_channels bytes
+};
+
+enum RenderLayout
+{
+	RenderInterleaved,	// Grayscale or RGB pixels at the image size
+	RenderPlanar		// Every component at its own (subsampled) size, without color conversion
+};
+
+struct StripPlane
+{
+	const uint8_t* data;
+	size_t stride;			// Distance between rows in data
+	size_t row_size;		// Bytes in each row of the whole plane
+	uint16_t height;		// Rows in the whole plane
+	uint16_t y;				// First row in this strip
+	uint16_t num_rows;
+};
+
+// The rows that became available after decoding one row of MCUs. Interleaved strips have a
+// single plane, planar strips one per component.
+struct Strip
+{
+	uint16_t width;
+	uint16_t height;
+	uint8_t num_channels;
+
+	size_t num_planes;
+	struct StripPlane planes[3];
+};
+
+// Returns 0 to continue rendering
+typedef int (*StripCallback)(const struct Strip* strip, void* user_data);
+
+// Reconstructs samples from the decoded coefficients at 1/scale of the image size, where scale is
+// 1, 2, 4 or 8. Reduced sizes only run a 4x4, 2x2 or DC-only IDCT per block. Chroma is upsampled
+// by replication. The image must have been loaded with LoadDecodeScans (LoadDCOnly is enough for
+// a scale of 8) and have one (grayscale) or three (YCbCr or RGB) components.
+int render_jpeg(JPEG* jpeg, unsigned scale, struct Image* image);
+
+// Like render_jpeg(), but hands out every row of MCUs as soon as it is reconstructed instead of
+// assembling the whole image. The strip buffers are reused for the next row of MCUs.
+int render_strips(JPEG* jpeg, unsigned scale, enum RenderLayout layout, StripCallback callback, void* user_data);
+
+void free_image(struct Image* image);
+
+#endif // _RENDER_H
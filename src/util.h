@@ -5,10 +5,11 @@
 
 #define ERROR_LOG(...) fprintf(stderr, "[ERROR] "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n");
 
+// Debug output goes to stderr like errors, so image data written to stdout stays intact
 #ifdef NDEBUG
 	#define DEBUG_LOG
 #else
-	#define DEBUG_LOG(...) printf("[DEBUG] "); printf(__VA_ARGS__); printf("\n")
+	#define DEBUG_LOG(...) fprintf(stderr, "[DEBUG] "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
 #endif
 
 #if defined(__GNUC__)
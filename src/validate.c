@@ -0,0 +1,178 @@
+#include "validate.h"
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+int validate_jpeg(const char* filename, struct ValidationError* error)
+{
+	assert(filename);
+	assert(error);
+
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		error->offset = -1;
+		snprintf(error->message, sizeof(error->message), "Failed to open file");
+		return 1;
+	}
+
+	return validate_jpeg_stream(fp, error);
+}
+
+int validate_jpeg_stream(FILE* fp, struct ValidationError* error)
+{
+	assert(fp);
+	assert(error);
+
+	memset(error, 0, sizeof(struct ValidationError));
+
+	JPEG* jpeg = (JPEG*)malloc(sizeof(JPEG));
+	if (jpeg == NULL)
+	{
+		fclose(fp);
+
+		error->offset = -1;
+		snprintf(error->message, sizeof(error->message), "Out of memory");
+		return 1;
+	}
+
+	memset(jpeg, 0, sizeof(JPEG));
+	jpeg->flags = LoadValidate;
+
+	int result = load_jpeg_stream(jpeg, fp);
+	if (result != 0)
+	{
+		error->offset = jpeg->error_offset;
+		memcpy(error->message, jpeg->error_message, sizeof(error->message));
+	}
+
+	free_jpeg(jpeg);
+	return result;
+}
+
+int validate_frame_header(JPEG* jpeg, long offset)
+{
+	assert(jpeg);
+
+	struct FrameHeader* frame_header = jpeg->frame_header;
+	uint8_t process = frame_header->encoding & ENCODING_PROCESS_MASK;
+
+	size_t expected_length = FRAME_HEADER_SIZE + sizeof(struct FrameComponent) * frame_header->num_components;
+	if (frame_header->length != expected_length)
+	{
+		jpeg_error(jpeg, offset, "Frame header length %u doesn't match its %u components", frame_header->length, frame_header->num_components);
+		return 1;
+	}
+
+	if (frame_header->num_components == 0 || frame_header->num_samples == 0)
+	{
+		jpeg_error(jpeg, offset, "Frame has no components or no samples per line");
+		return 1;
+	}
+
+	if (process == Progressive && frame_header->num_components > MAX_SCAN_COMPONENTS)
+	{
+		jpeg_error(jpeg, offset, "Progressive frame has %u components", frame_header->num_components);
+		return 1;
+	}
+
+	int valid_precision;
+	if (process == Lossless)
+		valid_precision = frame_header->precision >= 2 && frame_header->precision <= 16;
+	else if (process == Baseline)
+		valid_precision = frame_header->precision == 8;
+	else
+		valid_precision = frame_header->precision == 8 || frame_header->precision == 12;
+
+	if (!valid_precision)
+	{
+		jpeg_error(jpeg, offset, "Invalid sample precision %u", frame_header->precision);
+		return 1;
+	}
+
+	for (size_t c = 0; c < frame_header->num_components; c++)
+	{
+		struct FrameComponent* component = frame_header->components + c;
+
+		if (component->sampling_factor.h > 4 || component->sampling_factor.v > 4)
+		{
+			jpeg_error(jpeg, offset, "Component %u has an invalid sampling factor", component->identifier);
+			return 1;
+		}
+
+		if (component->quantization_table > 3)
+		{
+			jpeg_error(jpeg, offset, "Component %u uses invalid quantization table %u", component->identifier, component->quantization_table);
+			return 1;
+		}
+
+		for (size_t other = 0; other < c; other++)
+		{
+			if (frame_header->components[other].identifier == component->identifier)
+			{
+				jpeg_error(jpeg, offset, "Component identifier %u is used twice", component->identifier);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int validate_scan_tables(JPEG* jpeg, const struct ScanHeader* scan_header, long offset)
+{
+	assert(jpeg);
+	assert(scan_header);
+
+	// Lossless scans don't use quantization tables
+	if ((jpeg->frame_header->encoding & ENCODING_PROCESS_MASK) == Lossless)
+		return 0;
+
+	// Tables have to be defined before the first scan of every component that uses them
+	for (size_t i = 0; i < scan_header->num_components; i++)
+	{
+		for (size_t c = 0; c < jpeg->frame_header->num_components; c++)
+		{
+			struct FrameComponent* component = jpeg->frame_header->components + c;
+			if (component->identifier != scan_header->components[i].identifier)
+				continue;
+
+			if (find_quantization_table(jpeg, component->quantization_table) == NULL)
+			{
+				jpeg_error(jpeg, offset, "Component %u uses undefined quantization table %u", component->identifier, component->quantization_table);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int validate_image_complete(JPEG* jpeg, long offset)
+{
+	assert(jpeg);
+
+	if (jpeg->frame_header == NULL || jpeg->num_scan_headers == 0)
+	{
+		jpeg_error(jpeg, offset, "Image has no frame or no scans");
+		return 1;
+	}
+
+	for (size_t c = 0; c < jpeg->frame_header->num_components; c++)
+	{
+		uint8_t identifier = jpeg->frame_header->components[c].identifier;
+
+		int scanned = 0;
+		for (size_t i = 0; i < jpeg->num_scans && !scanned; i++)
+			scanned = (jpeg->scans[i].frame_component->identifier == identifier);
+
+		if (!scanned)
+		{
+			jpeg_error(jpeg, offset, "Component %u is never scanned", identifier);
+			return 1;
+		}
+	}
+
+	return 0;
+}
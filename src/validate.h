@@ -0,0 +1,22 @@
+#ifndef _VALIDATE_H
+#define _VALIDATE_H
+
+#include "loader.h"
+
+struct ValidationError
+{
+	long offset;
+	char message[MAX_ERROR_MESSAGE_SIZE];
+};
+
+// Walks all segments and entropy-decodes every scan without reconstructing any samples.
+// Returns 0 for a valid file, otherwise the first error found is stored in error.
+int validate_jpeg(const char* filename, struct ValidationError* error);
+int validate_jpeg_stream(FILE* fp, struct ValidationError* error);
+
+// Checks used by the loader when it runs with LoadValidate
+int validate_frame_header(JPEG* jpeg, long offset);
+int validate_scan_tables(JPEG* jpeg, const struct ScanHeader* scan_header, long offset);
+int validate_image_complete(JPEG* jpeg, long offset);
+
+#endif // _VALIDATE_H
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include "huffman.h"
+
+static int expect(const char* name, const uint8_t num_codes[16], const uint8_t* values, int expect_valid)
+{
+	const struct HuffmanDecoder* decoder = acquire_huffman_decoder(num_codes, values);
+	if (decoder == NULL)
+	{
+		printf("%s: failed to build decoder\n", name);
+		return 1;
+	}
+
+	int valid = decoder->valid;
+	release_huffman_decoder(decoder);
+
+	if (valid != expect_valid)
+	{
+		printf("%s: expected %s, got %s\n", name, expect_valid ? "valid" : "invalid", valid ? "valid" : "invalid");
+		return 1;
+	}
+
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+int main(void)
+{
+	static const uint8_t values[4] = { 0, 1, 2, 3 };
+	int num_failed = 0;
+
+	// 0, 10, 110
+	static const uint8_t prefix_free[16] = { 1, 1, 1 };
+	num_failed += expect("codes below all-ones", prefix_free, values, 1);
+
+	// 0, 10, 110, 111 uses the all-ones code (T.81, C.2)
+	static const uint8_t all_ones[16] = { 1, 1, 2 };
+	num_failed += expect("all-ones code", all_ones, values, 0);
+
+	// 0, 1
+	static const uint8_t single_bit[16] = { 2 };
+	num_failed += expect("all-ones code of length 1", single_bit, values, 0);
+
+	// Three codes of length 1 don't fit at all
+	static const uint8_t overfull[16] = { 3 };
+	num_failed += expect("overfull length", overfull, values, 0);
+
+	clear_huffman_cache();
+	return (num_failed > 0) ? 1 : 0;
+}
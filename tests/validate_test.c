@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "loader.h"
+#include "validate.h"
+
+// 8x8 grayscale baseline image, quantization table 0 and optimized Huffman tables
+static const uint8_t valid_image[] =
+{
+	0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 0x4A, 0x46, 0x49, 0x46, 0x00, 0x01,
+	0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0xFF, 0xDB, 0x00, 0x43,
+	0x00, 0x08, 0x06, 0x06, 0x07, 0x06, 0x05, 0x08, 0x07, 0x07, 0x07, 0x09,
+	0x09, 0x08, 0x0A, 0x0C, 0x14, 0x0D, 0x0C, 0x0B, 0x0B, 0x0C, 0x19, 0x12,
+	0x13, 0x0F, 0x14, 0x1D, 0x1A, 0x1F, 0x1E, 0x1D, 0x1A, 0x1C, 0x1C, 0x20,
+	0x24, 0x2E, 0x27, 0x20, 0x22, 0x2C, 0x23, 0x1C, 0x1C, 0x28, 0x37, 0x29,
+	0x2C, 0x30, 0x31, 0x34, 0x34, 0x34, 0x1F, 0x27, 0x39, 0x3D, 0x38, 0x32,
+	0x3C, 0x2E, 0x33, 0x34, 0x32, 0xFF, 0xC0, 0x00, 0x0B, 0x08, 0x00, 0x08,
+	0x00, 0x08, 0x01, 0x01, 0x11, 0x00, 0xFF, 0xC4, 0x00, 0x14, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x05, 0xFF, 0xC4, 0x00, 0x17, 0x10, 0x01, 0x00, 0x03,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x00, 0x04, 0x31, 0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00,
+	0x00, 0x3F, 0x00, 0x4A, 0x8A, 0x01, 0x93, 0xFF, 0xD9
+};
+
+#define FRAME_COMPONENT_TABLE_OFFSET 101
+#define FIRST_DQT_OFFSET 20
+#define FIRST_DHT_VALUES_OFFSET 123
+
+static int expect(const char* name, const uint8_t* data, size_t size, int expect_valid)
+{
+	FILE* fp = open_memory_file(data, size);
+	if (fp == NULL)
+	{
+		printf("%s: failed to open memory file\n", name);
+		return 1;
+	}
+
+	struct ValidationError error;
+	int valid = validate_jpeg_stream(fp, &error) == 0;
+
+	if (valid != expect_valid)
+	{
+		printf("%s: expected %s, got %s (%s)\n", name, expect_valid ? "valid" : "invalid", valid ? "valid" : "invalid", error.message);
+		return 1;
+	}
+
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+static int expect_error_offset(const char* name, const uint8_t* data, size_t size, long expected_offset)
+{
+	FILE* fp = open_memory_file(data, size);
+	if (fp == NULL)
+	{
+		printf("%s: failed to open memory file\n", name);
+		return 1;
+	}
+
+	struct ValidationError error;
+	if (validate_jpeg_stream(fp, &error) == 0)
+	{
+		printf("%s: expected invalid, got valid\n", name);
+		return 1;
+	}
+
+	if (error.offset != expected_offset)
+	{
+		printf("%s: expected error at offset %ld, got %ld (%s)\n", name, expected_offset, error.offset, error.message);
+		return 1;
+	}
+
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+int main(void)
+{
+	int num_failed = 0;
+	uint8_t buffer[sizeof(valid_image) + 2];
+
+	num_failed += expect("valid image", valid_image, sizeof(valid_image), 1);
+
+	// No SOI at the start
+	num_failed += expect("missing SOI", valid_image + 2, sizeof(valid_image) - 2, 0);
+
+	// A second SOI between the segments
+	memcpy(buffer, valid_image, FIRST_DQT_OFFSET);
+	buffer[FIRST_DQT_OFFSET] = 0xFF;
+	buffer[FIRST_DQT_OFFSET + 1] = 0xD8;
+	memcpy(buffer + FIRST_DQT_OFFSET + 2, valid_image + FIRST_DQT_OFFSET, sizeof(valid_image) - FIRST_DQT_OFFSET);
+	num_failed += expect("second SOI", buffer, sizeof(valid_image) + 2, 0);
+
+	// The component refers to a quantization table that is never defined
+	memcpy(buffer, valid_image, sizeof(valid_image));
+	buffer[FRAME_COMPONENT_TABLE_OFFSET] = 1;
+	num_failed += expect("undefined quantization table", buffer, sizeof(valid_image), 0);
+
+	// The file ends inside the values of the first Huffman table, which is reported where the read failed
+	num_failed += expect_error_offset("truncated DHT", valid_image, FIRST_DHT_VALUES_OFFSET, FIRST_DHT_VALUES_OFFSET);
+
+	return (num_failed > 0) ? 1 : 0;
+}